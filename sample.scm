@@ -14,3 +14,45 @@
 (= x x x)
 (length '(x x x))
 (fib 9)
+(define square (lambda (x) (* x x)))
+(square (+ 1 (* 2 1)))
+(if (>= 2 1) 'yes 'no)
+(car (cdr '(1 2 3)))
+(define-syntax swap! (syntax-rules ()
+                       ((_ a b) (let ((tmp a)) (begin (set! a b) (set! b tmp))))))
+(define tmp 1)
+(define y 2)
+(swap! tmp y)
+(cons tmp y)
+(let ((a 1) (b 2)) (cond ((= a b) 'same) (else (+ a b))))
+(define (list first . rest) (cons first rest))
+(list 1 2 3)
+(define (getx) x)
+(getx)
+(set! x 20)
+(getx)
+(+ 1 . 2)
+'(1 . (2 . 3))
+(define d (load-data "sample.dat"))
+(car d)
+(+ (car (cdr d)) 1)
+(car (cdr (cdr d)))
+(set-car! d 0)
+(load-data "empty.dat")
+(define (down n) (if (= n 0) 0 (+ 1 (down (- n 1)))))
+(down 1000000)
+(define-syntax inc (syntax-rules () ((_ n) (+ n 1))))
+(let ((+ -)) (inc 5))
+(define-syntax twice (syntax-rules ()
+                       ((_ body) (begin (define (loop i) (if (= i 0) 'done (begin body (loop (- i 1)))))
+                                        (loop 2)))))
+(define loop 'mine)
+(twice (set! x (+ x 1)))
+(cons loop x)
+(define (build n acc) (if (= n 0) acc (build (- n 1) (cons n acc))))
+(define (g k) ((lambda (z) (begin (build 3000 '()) z)) k))
+(define (rep i) (if (= i 0) 'done (begin (g i) (rep (- i 1)))))
+(rep 30)
+(define (f x) x)
+(define-syntax m (syntax-rules () ((_ e) (begin (f e) ((lambda (f) f) 1)))))
+(m 2)
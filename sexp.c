@@ -18,139 +18,112 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
-#include <stdio.h>
-#include <ctype.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdarg.h>
-
-#define BUFLEN 1024
-#define POOLSIZE 4096
-
-#define isreserved(c) (c == ')' || c == '(' || c == '\'')
-
-#define car(p) (p->pair[0])
-#define cdr(p) (p->pair[1])
-#define cadr(p) (car(cdr(p)))
-#define caddr(p) (car(cdr(cdr(p))))
-#define cadddr(p) (car(cdr(cdr(cdr(p)))))
-
-enum category {QUOTE, LPAREN, RPAREN, SYM, END};
-
-typedef struct SExp SExp;
-struct SExp {
-        union {
-                char *atom;
-                SExp *pair[2];
-                SExp *(*prim)(SExp *);
-        };
-        enum {ATOM, PAIR, NIL, PRIM} type;
-        int live; /* gc flag */
-};
-
-/** Memory management */
-SExp *alloc(void);
-void gc(void);
-void mark(SExp *exp);
-void sweep(void);
-void compact(void);
-void reclaim(SExp *exp);
-
-/** Constructors */
-SExp *cons(SExp *car, SExp *cdr);
-SExp *mkatom(char *str);
-SExp *mkpair(SExp *car, SExp *cdr);
-SExp *mkprim(SExp *(*prim)(SExp *));
-SExp *mkproc(SExp *params, SExp *body, SExp *env);
-
-/** I/O */
-int readtoken(FILE *f);
-SExp *parse(FILE *f, int depth);
-void print(SExp *exp);
-
-/** Error handling */
-void seterr(char *msg);
-
-/** Evaluation */
-SExp *apply(SExp *op, SExp *operands);
-SExp *eval(SExp *exp, SExp *env);
-SExp *evallist(SExp *ls, SExp *env);
-SExp *evallookup(SExp *exp, SExp *env);
-SExp *evalif(SExp *exp, SExp *env);
-SExp *evalcond(SExp *exp, SExp *env);
-SExp *evallambda(SExp *exp, SExp *env);
-SExp *evallet(SExp *exp, SExp *env);
-SExp *evaldefine(SExp *exp, SExp *env);
-SExp *evalset(SExp *exp, SExp *env);
-SExp *evalbegin(SExp *exp, SExp *env);
-SExp *evalapply(SExp *exp, SExp *env);
-int atomic(SExp *exp);
-int compound(SExp *exp);
-int empty(SExp *exp);
-int number(SExp *exp);
-int primproc(SExp *exp);
-int tagged(SExp *ls, char *tag);
-int length(SExp *exp);
-int eqsym(SExp *atom, char *str);
-
-/** Environment */
-SExp *envbind(SExp *var, SExp *val, SExp *env);
-SExp *envlookup(SExp *var, SExp *env);
-SExp *extend(SExp *args, SExp *params, SExp *env);
-
-/** Primitives */
-void init(void);
-SExp *math(SExp *args, int type);
-SExp *cmp(SExp *args, int type);
-SExp *mutate(SExp *args, int type);
-SExp *primadd(SExp *args);
-SExp *primsub(SExp *args);
-SExp *primmult(SExp *args);
-SExp *primdiv(SExp *args);
-SExp *primcons(SExp *args);
-SExp *primcdr(SExp *args);
-SExp *primcar(SExp *args);
-SExp *primeq(SExp *args);
-SExp *primlt(SExp *args);
-SExp *primgt(SExp *args);
-SExp *primlte(SExp *args);
-SExp *primgte(SExp *args);
-SExp *primeql(SExp *args);
-SExp *primsetcar(SExp *args);
-SExp *primsetcdr(SExp *args);
+#include "sexp.h"
 
 char    buf[BUFLEN];    /* string buffer */
 char   *err = NULL;     /* for displaying errors */
 int     eof = 0;        /* end of file flag */
 int     verbose = 0;    /* verbosity */
-SExp   *pool[POOLSIZE]; /* heap references */
-int     counter = 0;    /* next free node in pool */
-SExp   *global;         /* global environment */
-SExp   *nil;            /* empty list */
-SExp   *true;           /* #t */
-SExp   *false;          /* #f */
+Slab   *slabs = NULL;   /* every slab allocated */
+int     nslabs = 0;     /* number of slabs */
+SExp   *freecells;      /* free pairs, chained through their cdr */
+Box    *freeboxes;      /* free boxes */
+Slab   *dataslab = NULL; /* DATA slab being filled */
+size_t  datanext;       /* next free slot in dataslab */
+SExp  **globals;        /* global bindings, a hash table of cell chains */
+int     nglobals = 0;   /* cells in it */
+int     globalsize = 0; /* buckets, a power of two */
+SExp   *macros;         /* syntax-rules macros, (name literals rules...) */
+SExp   *ellipsis;       /* marks a sequence of ellipsis matches */
+int     gensyms = 0;    /* counter for renamed macro variables */
+int     gcneeded = 0;   /* collect at the next safe point */
+int     gclimit = 16;   /* slabs to allow before that */
+Frame  *frames = NULL;  /* temporaries of running compiled code */
+SExp   *stack[STACKLEN]; /* arguments of the calls being made */
+int     sp = 0;         /* top of stack */
+int     depth = 0;      /* nested calls to eval() and callc() */
+SExp   *markstack[MARKLEN]; /* marked pairs still to scan */
+int     marksp = 0;
+int     markoverflow = 0; /* some didn't fit, see rescan() */
+SExp   *tailf = NULL;   /* pending tail call, see callc() */
+int     tailargc;       /* its arguments are on top of the stack */
+FILE   *cfuncs;         /* functions compiled so far */
+FILE   *cinit;          /* statements building the constants */
+int     nconsts = 0;    /* constants, k[] in compiled code */
+int     ncells = 0;     /* cached global bindings, c[] in compiled code */
+int     nfuncs = 0;
+int     nforms = 0;
+SExp   *csyms;          /* (symbol . index) of constant symbols */
+SExp   *ccells;         /* (symbol . index) of cached global bindings */
+
+/* derived syntax, loaded by init() */
+char   *prelude =
+        "(define-syntax let"
+        "  (syntax-rules ()"
+        "    ((_ ((name val) ...) body) ((lambda (name ...) body) val ...))))"
+        "(define-syntax cond"
+        "  (syntax-rules (else)"
+        "    ((_) 'ok)"
+        "    ((_ (else action)) action)"
+        "    ((_ (predicate action) clause ...)"
+        "     (if predicate action (cond clause ...)))))";
 
 void gc(void) {
-        mark(global);
+        Frame *f;
+        int i;
+
+        for (i = 0; i < globalsize; i++)
+                mark(globals[i]);
+        mark(macros);
+        mark(ellipsis);
+        mark(tailf);
+        for (i = 0; i < sp; i++)
+                mark(stack[i]);
+        for (f = frames; f != NULL; f = f->prev) {
+                for (i = 0; i < f->n; i++)
+                        mark(f->slots[i]);
+        }
         sweep();
-        compact();
+        gcneeded = 0;
 }
 
 int eqsym(SExp *atom, char *str) {
-        return !strcmp(atom->atom, str);
+        return !strncmp(symname(atom), str, box(atom)->len)
+                && str[box(atom)->len] == '\0';
+}
+
+int samesym(SExp *a, SExp *b) {
+        return box(a)->len == box(b)->len
+                && !memcmp(symname(a), symname(b), box(a)->len);
 }
 
 SExp *mkatom(char *s) {
-        SExp *exp;
+        Box *b;
 
-        exp = alloc();
-        if (exp == NULL)
+        b = allocbox();
+        if (b == NULL)
                 return NULL;
-        exp->atom = strdup(s);
-        if (exp->atom == NULL)
+        b->atom = strdup(s);
+        if (b->atom == NULL) {
+                seterr("malloc failed");
                 return NULL;
-        exp->type = ATOM;
-        return exp;
+        }
+        b->len = strlen(s);
+        b->type = ATOM;
+        return tagbox(b);
+}
+
+/* An atom in a DATA slab, naming len bytes of a mapped file in place. */
+SExp *mkdata(char *s, int len) {
+        Box *b;
+
+        b = (Box *)datacell();
+        if (b == NULL)
+                return NULL;
+        b->atom = s;
+        b->len = len;
+        b->type = ATOM;
+        return tagbox(b);
 }
 
 SExp *mkpair(SExp *car, SExp *cdr) {
@@ -161,33 +134,46 @@ SExp *mkpair(SExp *car, SExp *cdr) {
                 return NULL;
         car(exp) = car;
         cdr(exp) = cdr;
-        exp->type = PAIR;
         return exp;
 }
 
-SExp *mkprim(SExp *(*prim)(SExp *)) {
-        SExp *exp;
+SExp *mknum(long n) {
+        return (SExp *)(((uintptr_t)n << 1) | 1);
+}
 
-        exp = alloc();
-        if (exp == NULL)
+SExp *mkprim(SExp *(*prim)(int, SExp **), int op) {
+        Box *b;
+
+        b = allocbox();
+        if (b == NULL)
                 return NULL;
-        exp->prim = prim;
-        exp->type = PRIM;
-        return exp;
+        b->prim = prim;
+        b->op = op;
+        b->type = PRIM;
+        return tagbox(b);
 }
 
-SExp *mkproc(SExp *params, SExp *body, SExp *env) {
-        return cons(mkatom("proc"), cons(params, cons(body, cons(env, nil))));
+SExp *mkcode(SExp *(*code)(SExp *, int, SExp **)) {
+        Box *b;
+
+        b = allocbox();
+        if (b == NULL)
+                return NULL;
+        b->code = code;
+        b->type = CODE;
+        return tagbox(b);
 }
 
-SExp *mknil(void) {
-        SExp *exp;
+SExp *mklist(int n, SExp **v) {
+        SExp *ls = nil;
 
-        exp = alloc();
-        if (exp == NULL)
-                return NULL;
-        exp->type = NIL;
-        return exp;
+        while (n-- > 0)
+                ls = cons(v[n], ls);
+        return ls;
+}
+
+SExp *mkproc(SExp *params, SExp *body, SExp *env) {
+        return cons(mkatom("proc"), cons(params, cons(body, cons(env, nil))));
 }
 
 SExp *cons(SExp *car, SExp *cdr) {
@@ -214,6 +200,16 @@ SExp *parse(FILE *f, int depth) {
                 return nil;
         } else if (category == QUOTE) {
                 car = cons(mkatom("quote"), cons(parse(f, 0), nil));
+        } else if (depth && !strcmp(buf, ".")) {
+                /* the rest of a dotted list */
+                cdr = parse(f, 0);
+                if (cdr != NULL && readtoken(f) != RPAREN) {
+                        seterr("malformed dotted list");
+                        return NULL;
+                }
+                return cdr;
+        } else if (numeric(buf, strlen(buf))) {
+                car = mknum(tonum(buf, strlen(buf)));
         } else {
                 car = mkatom(buf);
         }
@@ -223,36 +219,67 @@ SExp *parse(FILE *f, int depth) {
         return cons(car, cdr);
 }
 
-SExp *evallist(SExp *ls, SExp *env) {
-        if (empty(ls))
-                return nil;
-        return cons(eval(car(ls), env), evallist(cdr(ls), env));
+/* Evaluate args onto the stack, returning how many there were, or -1
+ * on error. The caller pops them. */
+int evalargs(SExp *args, SExp *env) {
+        int argc;
+
+        for (argc = 0; args != nil; args = cdr(args), argc++) {
+                if (push(eval(car(args), env)) == NULL)
+                        return -1;
+        }
+        return argc;
+}
+
+SExp *push(SExp *exp) {
+        if (exp == NULL)
+                return NULL;
+        if (sp == STACKLEN) {
+                seterr("stack overflow");
+                return NULL;
+        }
+        stack[sp++] = exp;
+        return exp;
 }
 
+/* Deep recursion fails with an error rather than overflowing the C
+ * stack. */
 SExp *eval(SExp *exp, SExp *env) {
-        if (empty(exp))
-                return nil;
-        if (atomic(exp)) {
-                if (number(exp))
-                        return exp;
-                return evallookup(exp, env);
+        SExp *result;
+
+        if (depth == MAXDEPTH) {
+                seterr("recursion too deep");
+                return NULL;
         }
+        depth++;
+        result = evalexp(exp, env);
+        depth--;
+        return result;
+}
+
+SExp *evalexp(SExp *exp, SExp *env) {
+        if (atomic(exp))
+                return evallookup(exp, env);
+        if (!compound(exp))
+                return exp;
+        if (inlined(exp))
+                return evalprim(exp, env);
+        if (globalref(exp))
+                return evalglobal(exp);
         if (tagged(exp, "if"))
                 return evalif(exp, env);
-        if (tagged(exp, "cond"))
-                return evalcond(exp, env);
         if (tagged(exp, "quote"))
                 return cadr(exp);
         if (tagged(exp, "lambda"))
                 return evallambda(exp, env);
-        if (tagged(exp, "let"))
-                return evallet(exp, env);
         if (tagged(exp, "define"))
                 return evaldefine(exp, env);
         if (tagged(exp, "set!"))
                 return evalset(exp, env);
         if (tagged(exp, "begin"))
                 return evalbegin(exp, env);
+        if (tagged(exp, "load-data"))
+                return evalloaddata(exp, env);
         return evalapply(exp, env);
 }
 
@@ -262,87 +289,59 @@ SExp *evallookup(SExp *exp, SExp *env) {
         kv = envlookup(exp, env);
         if (kv == NULL)
                 return NULL;
-        return cdr(kv);
+        return car(kv);
+}
+
+/* (<global> cell . symbol)
+ * A global reference, built by optimize(). The first evaluation finds
+ * the binding cell and keeps it in cell. define and set! only ever
+ * update a cell's value, so the cell stays valid for good. */
+SExp *evalglobal(SExp *exp) {
+        SExp *cell;
+
+        if (cadr(exp) == nil) {
+                cell = globalcell(cddr(exp));
+                if (cell == NULL) {
+                        seterr("undefined variable");
+                        return NULL;
+                }
+                cadr(exp) = cell;
+        }
+        return car(cadr(exp));
 }
 
 /* (if c1 a1 a2) */
 SExp *evalif(SExp *exp, SExp *env) {
         SExp *predicate, *truepart, *falsepart;
 
-        if (length(exp) == 4) {
+        if (length(exp) != 4) {
                 seterr("malformed if statement");
                 return NULL;
         }
         predicate = eval(cadr(exp), env);
+        if (predicate == NULL)
+                return NULL;
         truepart = caddr(exp);
         falsepart = cadddr(exp);
         return eval(predicate == false ? falsepart : truepart, env);
 }
 
-/* (cond (c1 a1)
- *       (c2 a2)
- *       (c3 a3)
- *       (else a4)) */
-SExp *evalcond(SExp *exp, SExp *env) {
-        SExp *clause, *predicate, *action;
-
-        for (exp = cdr(exp); exp != nil; exp = cdr(exp)) {
-                clause = car(exp);
-                predicate = car(clause);
-                action = cadr(clause);
-                if (eqsym(predicate, "else")) {
-                        if (cdr(exp) != nil) {
-                                seterr("malformed cond");
-                                return NULL;
-                        }
-                        return eval(action, env);
-                }
-                if (eval(predicate, env) != false)
-                        return eval(action, env);
-        }
-        return mkatom("ok");
-}
-
-/* (lambda (params) expr) */
+/* (lambda (params) expr)
+ * OR (lambda (params . rest) expr)
+ * OR (lambda rest expr) */
 SExp *evallambda(SExp *exp, SExp *env) {
         SExp *params, *body;
 
         if (length(exp) == 3) {
                 params = cadr(exp);
                 body = caddr(exp);
-                if (compound(params) || empty(params))
+                if (compound(params) || empty(params) || atomic(params))
                         return mkproc(params, body, env);
         }
         seterr("malformed lambda statement");
         return NULL;
 }
 
-/* (let ((var1 val1) (var2 val2)) body) */
-SExp *evallet(SExp *exp, SExp *env) {
-	SExp *bindings, *body, *var, *val;
-	SExp *params = nil, *args = nil;
-	
-	if (length(exp) != 3 || 
-		(!empty(cadr(exp)) && !compound(cadr(exp)))) {
-		seterr("malformed let");
-		return NULL;
-	}
-	body = caddr(exp);
-	for (bindings = cadr(exp); bindings != nil; bindings = cdr(bindings)) {
-		if (length(car(bindings)) != 2) {
-			seterr("malformed let");
-			return NULL;
-		}
-		var = car(car(bindings));
-		params = cons(var, params);
-		val = cadr(car(bindings));
-		args = cons(eval(val, env), args);
-	}
-	if (params == NULL || args == NULL)
-		return NULL;
-	return apply(mkproc(params, body, env), args);
-}
-
 /* (define symbol value)
  * OR (define (symbol params) body) */
 SExp *evaldefine(SExp *exp, SExp *env) {
@@ -372,11 +371,21 @@ SExp *evalset(SExp *exp, SExp *env) {
         if (length(exp) == 3) {
                 var = cadr(exp);
                 val = eval(caddr(exp), env);
+                if (globalref(var)) {
+                        /* from a macro template, see subst() */
+                        kv = globalcell(cddr(var));
+                        if (kv == NULL)
+                                seterr("undefined variable");
+                        if (val == NULL || kv == NULL)
+                                return NULL;
+                        car(kv) = val;
+                        return mkatom("ok");
+                }
                 if (atomic(var) && !number(var)) {
                         kv = envlookup(var, env);
                         if (val == NULL || kv == NULL)
                                 return NULL;
-                        cdr(kv) = val;
+                        car(kv) = val;
                         return mkatom("ok");
                 }
         }
@@ -386,7 +395,7 @@ SExp *evalset(SExp *exp, SExp *env) {
 
 /* (begin e1 e2 e3 ...) */
 SExp *evalbegin(SExp *exp, SExp *env) {
-        SExp *seq, *result;
+        SExp *seq, *result = nil;
 
         for (seq = cdr(exp); seq != nil; seq = cdr(seq)) {
                 result = eval(car(seq), env);
@@ -396,422 +405,2039 @@ SExp *evalbegin(SExp *exp, SExp *env) {
         return result;
 }
 
-SExp *evalapply(SExp *exp, SExp *env) {
-        SExp *op, *operands;
+/* (load-data "file") */
+SExp *evalloaddata(SExp *exp, SExp *env) {
+        char *s;
+        int len;
 
-        op = eval(car(exp), env);
-        operands = evallist(cdr(exp), env);
-        if (op == NULL || operands == NULL)
+        if (length(exp) != 2 || !atomic(cadr(exp))) {
+                seterr("malformed load-data");
                 return NULL;
-        return apply(op, operands);
+        }
+        s = symname(cadr(exp));
+        len = box(cadr(exp))->len;
+        if (len >= 2 && s[0] == '"' && s[len-1] == '"') {
+                s++;
+                len -= 2;
+        }
+        snprintf(buf, BUFLEN, "%.*s", len, s);
+        return loaddata(buf);
+}
+
+/* The operator and arguments are evaluated onto the stack, so the call
+ * itself conses nothing but the callee's frame. */
+SExp *evalapply(SExp *exp, SExp *env) {
+        SExp *result = NULL;
+        int base = sp, argc;
+
+        if (push(eval(car(exp), env)) != NULL) {
+                argc = evalargs(cdr(exp), env);
+                if (argc >= 0)
+                        result = apply(stack[base], argc, &stack[base+1]);
+        }
+        sp = base;
+        return result;
 }
 
-SExp *apply(SExp *op, SExp *operands) {
-        SExp *body, *params, *env;
+SExp *apply(SExp *op, int argc, SExp **argv) {
+        SExp *env;
 
         if (primproc(op))
-                return op->prim(operands);
+                return box(op)->prim(argc, argv);
+        if (compiled(op))
+                return callc(op, argc, argv);
         if (!tagged(op, "proc")) {
                 seterr("not a procedure");
                 return NULL;
         }
-        params = cadr(op);
-        if (length(params) != length(operands)) {
-                seterr("wrong number of arguments");
-                return NULL;
-        }
-        body = caddr(op);
-        env = extend(params, operands, cadddr(op));
+        env = extend(cadr(op), argc, argv, cadddr(op));
         if (env == NULL)
                 return NULL;
-        return eval(body, env);
+        return eval(caddr(op), env);
+}
+
+/* (<prim> <cell> <value> arg1 arg2 ...)
+ * An inlined primitive call, built by optcall(). <cell> is the global
+ * binding the primitive was found in and <value> the folded result, or
+ * nil if the arguments weren't constant. */
+SExp *evalprim(SExp *exp, SExp *env) {
+        SExp *result = NULL;
+        int base = sp, argc;
+
+        if (intact(exp)) {
+                if (caddr(exp) != nil)
+                        return caddr(exp);
+                return evalop(box(car(exp))->op, cdddr(exp), env);
+        }
+        /* the binding was redefined, call whatever it holds now */
+        argc = evalargs(cdddr(exp), env);
+        if (argc >= 0)
+                result = apply(car(cadr(exp)), argc, &stack[base]);
+        sp = base;
+        return result;
+}
+
+/* Evaluate an inlined primitive directly on its argument expressions,
+ * without looking up the operator. */
+SExp *evalop(int op, SExp *args, SExp *env) {
+        SExp *result = NULL;
+        int base = sp, argc;
+
+        argc = evalargs(args, env);
+        if (argc >= 0)
+                result = primop(op, argc, &stack[base]);
+        sp = base;
+        return result;
 }
 
+/* The length of a list, or -1 if it's dotted. */
 int length(SExp *exp) {
         int len;
 
-        for (len = 0; exp != nil; exp = cdr(exp))
+        for (len = 0; compound(exp); exp = cdr(exp))
                 len++;
-        return len;
+        return exp == nil ? len : -1;
 }
 
-SExp *extend(SExp *params, SExp *args, SExp *env) {
-        SExp *frame = nil;
+/* A frame binding params to the arguments, see framecell(). */
+SExp *extend(SExp *params, int argc, SExp **argv, SExp *env) {
+        SExp *ls, *vals;
+        int n = 0;
 
-        for (; args != nil; args = cdr(args), params = cdr(params))
-                frame = cons(cons(car(params), car(args)), frame);
-        return cons(frame, env);
+        for (ls = params; compound(ls); ls = cdr(ls))
+                n++;
+        vals = bindargs(argc, argv, n, ls != nil, nil);
+        if (vals == NULL)
+                return NULL;
+        return cons(cons(params, vals), env);
 }
 
-void reclaim(SExp *exp) {
-        if (exp->type == ATOM)
-                free(exp->atom);
-        free(exp);
+/* The values of nparams parameters in front of vals, followed by a list
+ * of the remaining arguments if there's a rest parameter. */
+SExp *bindargs(int argc, SExp **argv, int nparams, int rest, SExp *vals) {
+        if (rest ? argc < nparams : argc != nparams) {
+                seterr("wrong number of arguments");
+                return NULL;
+        }
+        if (rest)
+                vals = cons(mklist(argc - nparams, argv + nparams), vals);
+        while (nparams-- > 0)
+                vals = cons(argv[nparams], vals);
+        return vals;
 }
 
-enum {ADD, SUB, MULT, DIV};
-SExp *math(SExp *args, int type) {
-        int n, x;
+/* Run a numeric primitive or car/cdr on argc values. */
+SExp *primop(int op, int argc, SExp **argv) {
+        long n, m;
+        int i, result = 1;
 
-        if (args == nil) {
+        if (op == OP_CAR || op == OP_CDR) {
+                if (argc != 1) {
+                        seterr("wrong number of arguments");
+                        return NULL;
+                }
+                if (!compound(argv[0])) {
+                        seterr(op == OP_CAR ? "invalid argument to car" :
+                                        "invalid argument to cdr");
+                        return NULL;
+                }
+                return op == OP_CAR ? car(argv[0]) : cdr(argv[0]);
+        }
+        for (i = 0; i < argc; i++) {
+                if (!number(argv[i])) {
+                        seterr(iscmp(op) ? "invalid argument to compare" :
+                                        "invalid argument");
+                        return NULL;
+                }
+        }
+        if (argc == 0) {
+                if (iscmp(op))
+                        return true;
                 seterr("missing argument");
                 return NULL;
         }
-        n = atoi(car(args)->atom);
-        for (args = cdr(args); args != nil; args = cdr(args)) {
-                if (!number(car(args))) {
-                        seterr("invalid argument");
+        n = fixval(argv[0]);
+        for (i = 1; i < argc; i++) {
+                m = fixval(argv[i]);
+                if (iscmp(op)) {
+                        result = result && compare(op, n, m);
+                        n = m;
+                } else if (op == OP_DIV && m == 0) {
+                        seterr("division by zero");
                         return NULL;
-                }
-                x = atoi(car(args)->atom);
-                switch(type) {
-                        case ADD: n += x; break;
-                        case SUB: n -= x; break;
-                        case MULT: n *= x; break;
-                        default: n /= x;
+                } else {
+                        n = arith(op, n, m);
                 }
         }
-        snprintf(buf, BUFLEN, "%d", n);
-        return mkatom(buf);
+        if (iscmp(op))
+                return result ? true : false;
+        return mknum(n);
 }
 
-SExp *primadd(SExp *args) {
-        return math(args, ADD);
+long arith(int op, long n, long x) {
+        switch(op) {
+                case OP_ADD: return n + x;
+                case OP_SUB: return n - x;
+                case OP_MULT: return n * x;
+                default: return n / x;
+        }
 }
 
-SExp *primsub(SExp *args) {
-        return math(args, SUB);
+SExp *primadd(int argc, SExp **argv) {
+        return primop(OP_ADD, argc, argv);
 }
 
-SExp *primmult(SExp *args) {
-        return math(args, MULT);
+SExp *primsub(int argc, SExp **argv) {
+        return primop(OP_SUB, argc, argv);
 }
 
-SExp *primdiv(SExp *args) {
-        return math(args, DIV);
+SExp *primmult(int argc, SExp **argv) {
+        return primop(OP_MULT, argc, argv);
 }
 
-SExp *primcons(SExp *args) {
-        return cons(car(args), cadr(args));
+SExp *primdiv(int argc, SExp **argv) {
+        return primop(OP_DIV, argc, argv);
 }
 
-SExp *primcar(SExp *args) {
-        if (!compound(car(args))) {
-                seterr("invalid argument to car");
+SExp *primcons(int argc, SExp **argv) {
+        if (argc != 2) {
+                seterr("wrong number of arguments");
                 return NULL;
         }
-        return car(car(args));
+        return cons(argv[0], argv[1]);
 }
 
-SExp *primcdr(SExp *args) {
-        if (!compound(car(args))) {
-                seterr("invalid argument to cdr");
-                return NULL;
-        }
-        return cdr(car(args));
+SExp *primcar(int argc, SExp **argv) {
+        return primop(OP_CAR, argc, argv);
 }
 
-SExp *primeq(SExp *args) {
-        SExp *exp;
+SExp *primcdr(int argc, SExp **argv) {
+        return primop(OP_CDR, argc, argv);
+}
+
+SExp *primeq(int argc, SExp **argv) {
+        int i;
 
-        for (exp = car(args); args != nil; args = cdr(args)) {
-                if (car(args) != exp)
+        for (i = 1; i < argc; i++) {
+                if (argv[i] != argv[0])
                         return false;
         }
         return true;
 }
 
-enum {CMP_LT, CMP_GT, CMP_LTE, CMP_GTE, CMP_EQL};
-SExp *cmp(SExp *args, int type) {
-        int lhs, rhs, result;
-
-        for (; args != nil; args = cdr(args)) {
-                if (!number(car(args))) {
-                        seterr("invalid argument to compare");
-                        return NULL;
-                }
-                if (cdr(args) == nil)
-                        break;
-                lhs = atoi(car(args)->atom);
-                rhs = atoi(cadr(args)->atom);
-                switch(type) {
-                        case CMP_LT: result = lhs < rhs; break;
-                        case CMP_GT: result = lhs > rhs; break;
-                        case CMP_LTE: result = lhs <= rhs; break;
-                        case CMP_GTE: result = lhs <= rhs; break;
-                        default: result = lhs == rhs;
-                }
-                if (!result)
-                        return false;
+int compare(int op, long lhs, long rhs) {
+        switch(op) {
+                case OP_LT: return lhs < rhs;
+                case OP_GT: return lhs > rhs;
+                case OP_LTE: return lhs <= rhs;
+                case OP_GTE: return lhs >= rhs;
+                default: return lhs == rhs;
         }
-        return true;
 }
 
-SExp *primlt(SExp *args) {
-        return cmp(args, CMP_LT);
+SExp *primlt(int argc, SExp **argv) {
+        return primop(OP_LT, argc, argv);
 }
 
-SExp *primgt(SExp *args) {
-        return cmp(args, CMP_GT);
+SExp *primgt(int argc, SExp **argv) {
+        return primop(OP_GT, argc, argv);
 }
 
-SExp *primlte(SExp *args) {
-        return cmp(args, CMP_LTE);
+SExp *primlte(int argc, SExp **argv) {
+        return primop(OP_LTE, argc, argv);
 }
 
-SExp *primgte(SExp *args) {
-        return cmp(args, CMP_GTE);
+SExp *primgte(int argc, SExp **argv) {
+        return primop(OP_GTE, argc, argv);
 }
 
-SExp *primeql(SExp *args) {
-        return cmp(args, CMP_EQL);
+SExp *primeql(int argc, SExp **argv) {
+        return primop(OP_EQL, argc, argv);
 }
 
 enum {SETCAR, SETCDR};
-SExp *mutate(SExp *args, int type) {
-        SExp *pair, *val;
-
-        if (length(args) != 3) {
+SExp *mutate(int argc, SExp **argv, int type) {
+        if (argc != 2 || !compound(argv[0])) {
                 seterr("left side is atomic");
                 return NULL;
         }
-        pair = car(args);
-        val = cadr(args);
+        if (slabof(argv[0])->kind == DATA) {
+                seterr("data is read-only");
+                return NULL;
+        }
         if (type == SETCAR)
-                car(pair) = val;
+                car(argv[0]) = argv[1];
         else
-                cdr(pair) = val;
+                cdr(argv[0]) = argv[1];
         return mkatom("ok");
 }
 
-SExp *primsetcar(SExp *args) {
-        return mutate(args, SETCAR);
+SExp *primsetcar(int argc, SExp **argv) {
+        return mutate(argc, argv, SETCAR);
 }
 
-SExp *primsetcdr(SExp *args) {
-        return mutate(args, SETCDR);
+SExp *primsetcdr(int argc, SExp **argv) {
+        return mutate(argc, argv, SETCDR);
 }
 
 void init(void) {
-        nil = mknil();
-        global = cons(nil, nil);
-        envbind(mkatom("#t"), true = mkatom("#t"), global);
-        envbind(mkatom("#f"), false = mkatom("#f"), global);
-        envbind(mkatom("+"), mkprim(primadd), global);
-        envbind(mkatom("-"), mkprim(primsub), global);
-        envbind(mkatom("*"), mkprim(primmult), global);
-        envbind(mkatom("/"), mkprim(primdiv), global);
-        envbind(mkatom("cons"), mkprim(primcons), global);
-        envbind(mkatom("car"), mkprim(primcar), global);
-        envbind(mkatom("cdr"), mkprim(primcdr), global);
-        envbind(mkatom("eq?"), mkprim(primeq), global);
-        envbind(mkatom("<"), mkprim(primlt), global);
-        envbind(mkatom(">"), mkprim(primgt), global);
-        envbind(mkatom("<="), mkprim(primlte), global);
-        envbind(mkatom(">="), mkprim(primgte), global);
-        envbind(mkatom("="), mkprim(primeql), global);
-        envbind(mkatom("set-car!"), mkprim(primsetcar), global);
-        envbind(mkatom("set-cdr!"), mkprim(primsetcdr), global);
+        FILE *f;
+        SExp *exp;
+
+        if (globals == NULL && !growglobals())
+                return;
+        macros = nil;
+        ellipsis = mkatom("...");
+        globalbind(mkatom("#t"), true);
+        globalbind(mkatom("#f"), false);
+        globalbind(mkatom("+"), mkprim(primadd, OP_ADD));
+        globalbind(mkatom("-"), mkprim(primsub, OP_SUB));
+        globalbind(mkatom("*"), mkprim(primmult, OP_MULT));
+        globalbind(mkatom("/"), mkprim(primdiv, OP_DIV));
+        globalbind(mkatom("cons"), mkprim(primcons, OP_NONE));
+        globalbind(mkatom("car"), mkprim(primcar, OP_CAR));
+        globalbind(mkatom("cdr"), mkprim(primcdr, OP_CDR));
+        globalbind(mkatom("eq?"), mkprim(primeq, OP_NONE));
+        globalbind(mkatom("<"), mkprim(primlt, OP_LT));
+        globalbind(mkatom(">"), mkprim(primgt, OP_GT));
+        globalbind(mkatom("<="), mkprim(primlte, OP_LTE));
+        globalbind(mkatom(">="), mkprim(primgte, OP_GTE));
+        globalbind(mkatom("="), mkprim(primeql, OP_EQL));
+        globalbind(mkatom("set-car!"), mkprim(primsetcar, OP_NONE));
+        globalbind(mkatom("set-cdr!"), mkprim(primsetcdr, OP_NONE));
+        f = fmemopen(prelude, strlen(prelude), "r");
+        if (f == NULL)
+                return;
+        while ((exp = parse(f, 0)) != NULL)
+                expand(exp, nil);
+        fclose(f);
+        eof = 0;
 }
 
 SExp *envlookup(SExp *var, SExp *env) {
-        SExp *frame, *kv;
+        SExp *cell;
 
         for (; env != nil; env = cdr(env)) {
-                for (frame = car(env); frame != nil; frame = cdr(frame)) {
-                        kv = car(frame);
-                        if (eqsym(var, car(kv)->atom))
-                                return kv;
+                cell = framecell(var, car(env));
+                if (cell != NULL)
+                        return cell;
+        }
+        cell = globalcell(var);
+        if (cell == NULL)
+                seterr("undefined variable");
+        return cell;
+}
 
-                }
+/* Frames are (names . values), two parallel lists. A rest parameter
+ * ends the names, and its list of arguments is the last value. Returns
+ * the pair whose car holds var's value, or NULL. */
+SExp *framecell(SExp *var, SExp *frame) {
+        SExp *names, *vals;
+
+        names = car(frame);
+        for (vals = cdr(frame); names != nil; vals = cdr(vals)) {
+                if (atomic(names))
+                        return samesym(var, names) ? vals : NULL;
+                if (samesym(var, car(names)))
+                        return vals;
+                names = cdr(names);
         }
-        seterr("undefined variable");
         return NULL;
 }
 
 SExp *envbind(SExp *var, SExp *val, SExp *env) {
-        SExp *frame, *kv;
-
-        for (frame = car(env); frame != nil; frame = cdr(frame)) {
-                kv = car(frame);
-                if (eqsym(var, car(kv)->atom)) {
-                        cdr(kv) = val;
-                        return mkatom("ok");
-                }
+        SExp *frame, *cell, *names, *vals;
+
+        if (env == nil)
+                return globalbind(var, val);
+        frame = car(env);
+        cell = framecell(var, frame);
+        if (cell != NULL) {
+                car(cell) = val;
+                return mkatom("ok");
         }
-        car(env) = cons(cons(var, val), car(env));
-        if (car(env) == NULL)
+        names = cons(var, car(frame));
+        vals = cons(val, cdr(frame));
+        if (names == NULL || vals == NULL)
                 return NULL;
+        car(frame) = names;
+        cdr(frame) = vals;
         return mkatom("ok");
 }
 
-int atomic(SExp *exp) {
-        return exp->type == ATOM;
-}
-
-int compound(SExp *exp) {
-        return exp->type == PAIR;
+/* Globals are binding cells, (value . symbol), chained in the buckets
+ * of the globals hash table. The environment of top-level code is
+ * just (). Cells are never removed or replaced, so their addresses can
+ * be cached, see evalglobal(). */
+SExp *globalcell(SExp *var) {
+        SExp *chain;
+
+        chain = globals[hashsym(var) & (globalsize - 1)];
+        for (; chain != nil; chain = cdr(chain)) {
+                if (samesym(var, cdr(car(chain))))
+                        return car(chain);
+        }
+        return NULL;
 }
 
-int empty(SExp *exp) {
-        return exp->type == NIL;
-}
+SExp *globalbind(SExp *var, SExp *val) {
+        SExp *cell, **bucket;
 
-int primproc(SExp *exp) {
-        return exp->type == PRIM;
+        cell = globalcell(var);
+        if (cell != NULL) {
+                car(cell) = val;
+                return mkatom("ok");
+        }
+        if (nglobals >= globalsize && !growglobals())
+                return NULL;
+        bucket = &globals[hashsym(var) & (globalsize - 1)];
+        cell = cons(cons(val, var), *bucket);
+        if (cell == NULL)
+                return NULL;
+        *bucket = cell;
+        nglobals++;
+        return mkatom("ok");
 }
 
-int number(SExp *exp) {
-        char *s;
+/* Double the buckets, moving the chain pairs over as they are. */
+int growglobals(void) {
+        SExp **old = globals, *chain, *next, **bucket;
+        int i, oldsize = globalsize;
 
-        if (!atomic(exp))
+        globalsize = oldsize ? 2 * oldsize : 256;
+        globals = malloc(globalsize * sizeof(SExp *));
+        if (globals == NULL) {
+                seterr("malloc failed");
+                globals = old;
+                globalsize = oldsize;
                 return 0;
-        for (s = exp->atom; *s != '\0'; s++) {
-                if (!isdigit(*s))
-                        return 0;
         }
+        for (i = 0; i < globalsize; i++)
+                globals[i] = nil;
+        for (i = 0; i < oldsize; i++) {
+                for (chain = old[i]; chain != nil; chain = next) {
+                        next = cdr(chain);
+                        bucket = &globals[hashsym(cdr(car(chain))) & (globalsize - 1)];
+                        cdr(chain) = *bucket;
+                        *bucket = chain;
+                }
+        }
+        free(old);
         return 1;
 }
 
-int tagged(SExp *ls, char *tag) {
-        return compound(ls) && atomic(car(ls)) && eqsym(car(ls), tag);
+/* FNV-1a */
+unsigned long hashsym(SExp *sym) {
+        unsigned long h = 2166136261UL;
+        char *s = symname(sym);
+        int i;
+
+        for (i = 0; i < box(sym)->len; i++)
+                h = (h ^ (unsigned char)s[i]) * 16777619UL;
+        return h;
 }
 
-void print(SExp *exp) {
-        if (atomic(exp)) {
-                printf("%s", exp->atom);
-        } else if (empty(exp)) {
-                printf("()");
-        } else if (compound(exp)) {
-                if (tagged(exp, "proc")) {
-                        printf("PROC");
-                } else {
-                        printf("(");
-                        print(car(exp));
-                        printf(".");
-                        print(cdr(exp));
-                        printf(")");
+/* Expand the macro uses in exp, ahead of optimization. Each use is
+ * replaced in place by its expansion, so it's only ever expanded once.
+ * scope lists the local variables, which shadow macros. */
+SExp *expand(SExp *exp, SExp *scope) {
+        SExp *spec, *ls, *x;
+
+        while (compound(exp) && (spec = usedmacro(car(exp), scope)) != NULL) {
+                if (expanduse(exp, spec) == NULL)
+                        return NULL;
+        }
+        if (!compound(exp) || globalref(exp))
+                return exp;
+        if (tagged(exp, "quote")) {
+                if (length(exp) != 2) {
+                        seterr("malformed quote");
+                        return NULL;
                 }
-        } else if (primproc(exp)) {
-                printf("<built-in>");
+                return exp;
+        }
+        if (tagged(exp, "define-syntax"))
+                return defsyntax(exp);
+        if (tagged(exp, "lambda") && length(exp) == 3) {
+                scope = bindparams(cadr(exp), scope);
+                ls = cddr(exp);
+        } else if (tagged(exp, "define") && length(exp) == 3 && compound(cadr(exp))) {
+                scope = bindparams(cdr(cadr(exp)), scope);
+                ls = cddr(exp);
+        } else {
+                ls = exp;
+        }
+        for (; compound(ls); ls = cdr(ls)) {
+                x = expand(car(ls), scope);
+                if (x == NULL)
+                        return NULL;
+                car(ls) = x;
+        }
+        /* dotted lists are only data and parameter lists */
+        if (ls != nil) {
+                seterr("malformed expression");
+                return NULL;
         }
+        return exp;
 }
 
-int readtoken(FILE *f) {
-        char c;
-        int i;
+/* Rewrite the macro use exp with the first rule of spec it matches.
+ * Variables the template binds are renamed, so they can't capture
+ * variables at the use site, and its free variables refer to globals,
+ * so the use site can't capture them either. */
+SExp *expanduse(SExp *exp, SExp *spec) {
+        SExp *rules, *b, *x;
 
-        while (1) {
-                c = getc(f);
-                if (c == EOF)
-                        return END;
-                if (isspace(c))
+        for (rules = cdr(spec); rules != nil; rules = cdr(rules)) {
+                b = match(cdr(car(car(rules))), cdr(exp), car(spec), nil);
+                if (b == NULL)
                         continue;
-                if (c == '(')
-                        return LPAREN;
-                if (c == ')')
-                        return RPAREN;
-                if (c == '\'')
-                        return QUOTE;
-                break;
-        }
-        for (i = 0; i < BUFLEN-1; i++) {
-                buf[i] = c;
-                c = getc(f);
-                if (c == EOF)
-                        return END;
-                if (isreserved(c) || isspace(c))
-                        break;
+                x = cadr(car(rules));
+                x = subst(x, b, binders(x, b, nil), 0);
+                if (x == NULL)
+                        return NULL;
+                if (!compound(x))
+                        x = cons(mkatom("begin"), cons(x, nil));
+                if (x == NULL)
+                        return NULL;
+                car(exp) = car(x);
+                cdr(exp) = cdr(x);
+                return exp;
         }
-        buf[i+1] = '\0';
-        if (isreserved(c))
-                ungetc(c, f);
-        return SYM;
-}
-
-void seterr(char *msg) {
-        if (err == NULL)
-                err = msg;
+        seterr("no matching syntax rule");
+        return NULL;
 }
 
-SExp *alloc(void) {
-        SExp *exp;
+/* (define-syntax name (syntax-rules (literals) (pattern template) ...)) */
+SExp *defsyntax(SExp *exp) {
+        SExp *name, *rules, *ls;
 
-        if (counter == POOLSIZE) {
-                seterr("out of nodes");
+        if (length(exp) != 3 || !atomic(cadr(exp))
+                        || !tagged(caddr(exp), "syntax-rules")
+                        || length(caddr(exp)) < 2) {
+                seterr("malformed define-syntax");
                 return NULL;
         }
-        exp = calloc(1, sizeof(SExp));
-        if (exp == NULL) {
-                seterr("malloc failed");
-                return NULL;
+        name = cadr(exp);
+        rules = cdr(caddr(exp));
+        for (ls = cdr(rules); compound(ls); ls = cdr(ls)) {
+                if (!compound(car(ls)) || length(car(ls)) != 2
+                                || !compound(car(car(ls)))) {
+                        seterr("malformed syntax rule");
+                        return NULL;
+                }
         }
-        pool[counter++] = exp;
-        return exp;
+        for (ls = macros; ls != nil; ls = cdr(ls)) {
+                if (samesym(name, car(car(ls)))) {
+                        cdr(car(ls)) = rules;
+                        break;
+                }
+        }
+        if (ls == nil)
+                macros = cons(cons(name, rules), macros);
+        return cons(mkatom("quote"), cons(mkatom("ok"), nil));
 }
 
-void mark(SExp *exp) {
-        if (exp->live)
-                return;
-        exp->live = 1;
-        if (exp->type == PAIR) {
-                mark(car(exp));
-                mark(cdr(exp));
-        }
+/* The macro op names, if it isn't shadowed by a local variable. A
+ * global reference from a template always names the macro. */
+SExp *usedmacro(SExp *op, SExp *scope) {
+        if (globalref(op))
+                return macro(cddr(op));
+        if (atomic(op) && !inscope(op, scope))
+                return macro(op);
+        return NULL;
 }
 
-void sweep(void) {
-        int i;
-        SExp *exp;
-        int freed = 0;
+SExp *macro(SExp *name) {
+        SExp *kv;
 
-        for (i = 0; i < counter; i++) {
-                exp = pool[i];
-                if (exp->live) {
-                        exp->live = 0;
-                } else {
-                        freed++;
-                        reclaim(exp);
-                        pool[i] = NULL;
+        kv = binding(name, macros);
+        if (kv == NULL)
+                return NULL;
+        return cdr(kv);
+}
+
+/* Match form against pat, adding pattern variables to the bindings b.
+ * Returns NULL if it doesn't match. */
+SExp *match(SExp *pat, SExp *form, SExp *lits, SExp *b) {
+        if (atomic(pat)) {
+                if (inscope(pat, lits)) {
+                        if (globalref(form))
+                                form = cddr(form);
+                        return atomic(form) && samesym(form, pat) ? b : NULL;
                 }
+                if (eqsym(pat, "_"))
+                        return b;
+                return cons(cons(pat, form), b);
         }
-        if (verbose)
-                fprintf(stderr, "Reclaimed %d nodes\n", freed);
+        if (!compound(pat))
+                return pat == form ? b : NULL;
+        if (compound(cdr(pat)) && isellipsis(cadr(pat)) && cddr(pat) == nil)
+                return matchseq(car(pat), form, lits, b);
+        if (!compound(form))
+                return NULL;
+        b = match(car(pat), car(form), lits, b);
+        if (b == NULL)
+                return NULL;
+        return match(cdr(pat), cdr(form), lits, b);
 }
 
-void compact(void) {
-        SExp *alive[counter];
-        int i, j = 0;
+/* Match each of forms against pat. Each pattern variable is bound to
+ * the sequence of its matches, (<ellipsis> match1 match2 ...). */
+SExp *matchseq(SExp *pat, SExp *forms, SExp *lits, SExp *b) {
+        SExp *matches = nil, *vars, *seq, *ls, *m;
 
-        for (i = 0; i < counter; i++) {
-                if (pool[i] != NULL)
-                        alive[j++] = pool[i];
+        for (; compound(forms); forms = cdr(forms)) {
+                m = match(pat, car(forms), lits, nil);
+                if (m == NULL)
+                        return NULL;
+                matches = cons(m, matches);
         }
-        for (i = 0; i < j; i++)
-                pool[i] = alive[i];
-        counter = j;
+        if (!empty(forms))
+                return NULL;
+        for (vars = patvars(pat, lits, nil); vars != nil; vars = cdr(vars)) {
+                seq = nil;
+                for (ls = matches; ls != nil; ls = cdr(ls))
+                        seq = cons(cdr(binding(car(vars), car(ls))), seq);
+                b = cons(cons(car(vars), cons(ellipsis, seq)), b);
+        }
+        return b;
+}
+
+/* Instantiate template t with the pattern variables in b, and the
+ * renamed template variables in renames. Other variables are free in
+ * the template, and become global references so the use site can't
+ * capture them, unless they're quoted. A variable the template binds
+ * is only renamed within the lambda, let or define that binds it. */
+SExp *subst(SExp *t, SExp *b, SExp *renames, int quoted) {
+        SExp *kv, *head, *tail;
+
+        if (atomic(t)) {
+                kv = binding(t, b);
+                if (kv != NULL) {
+                        if (isseq(cdr(kv))) {
+                                seterr("missing ellipsis in template");
+                                return NULL;
+                        }
+                        return cdr(kv);
+                }
+                kv = binding(t, renames);
+                if (kv != NULL)
+                        return cdr(kv);
+                if (quoted || keyword(t))
+                        return t;
+                return cons(GLOBAL, cons(nil, t));
+        }
+        if (!compound(t))
+                return t;
+        if (tagged(t, "quote") || tagged(t, "load-data")) {
+                renames = nil;
+                quoted = 1;
+        }
+        if (!quoted && compound(cdr(t))) {
+                if (tagged(t, "let"))
+                        return substlet(t, b, renames);
+                if (tagged(t, "lambda"))
+                        renames = binders(cddr(t), b, freshparams(cadr(t), b, renames));
+                else if (tagged(t, "define") && compound(cadr(t)))
+                        renames = binders(cddr(t), b, freshparams(cdr(cadr(t)), b, renames));
+        }
+        if (compound(cdr(t)) && isellipsis(cadr(t)))
+                return substseq(car(t), cddr(t), b, renames, quoted);
+        head = subst(car(t), b, renames, quoted);
+        tail = subst(cdr(t), b, renames, quoted);
+        if (head == NULL || tail == NULL)
+                return NULL;
+        return cons(head, tail);
+}
+
+/* Instantiate (t ... . rest), once per match of the sequence variables
+ * in t. */
+SExp *substseq(SExp *t, SExp *rest, SExp *b, SExp *renames, int quoted) {
+        SExp *seqs = nil, *out = nil, *vars, *bi, *ls, *x;
+
+        for (vars = seqvars(t, b, nil); vars != nil; vars = cdr(vars))
+                seqs = cons(cons(car(vars), cddr(binding(car(vars), b))), seqs);
+        if (seqs == nil) {
+                seterr("no pattern variable before ellipsis");
+                return NULL;
+        }
+        while (cdr(car(seqs)) != nil) {
+                bi = b;
+                for (ls = seqs; ls != nil; ls = cdr(ls)) {
+                        if (cdr(car(ls)) == nil) {
+                                seterr("mismatched ellipsis");
+                                return NULL;
+                        }
+                        bi = cons(cons(car(car(ls)), cadr(car(ls))), bi);
+                        cdr(car(ls)) = cddr(car(ls));
+                }
+                x = subst(t, bi, renames, quoted);
+                if (x == NULL)
+                        return NULL;
+                out = cons(x, out);
+        }
+        x = subst(rest, b, renames, quoted);
+        for (; x != NULL && out != nil; out = cdr(out))
+                x = cons(car(out), x);
+        return x;
+}
+
+/* (let ((name val) ...) body), where the names are only in scope in
+ * the body. */
+SExp *substlet(SExp *t, SExp *b, SExp *renames) {
+        SExp *inner = renames, *ls, *head, *bindings, *body;
+
+        for (ls = cadr(t); compound(ls); ls = cdr(ls)) {
+                if (compound(car(ls)))
+                        inner = fresh(car(car(ls)), b, inner);
+        }
+        inner = binders(cddr(t), b, inner);
+        head = subst(car(t), b, renames, 0);
+        bindings = substbinds(cadr(t), b, renames, inner);
+        body = subst(cddr(t), b, inner, 0);
+        if (head == NULL || bindings == NULL || body == NULL)
+                return NULL;
+        return cons(head, cons(bindings, body));
+}
+
+/* Instantiate let bindings, renaming the names with inner and the values
+ * with renames. */
+SExp *substbinds(SExp *ls, SExp *b, SExp *renames, SExp *inner) {
+        SExp *name, *val, *rest;
+
+        if (!compound(ls) || !compound(car(ls))
+                        || (compound(cdr(ls)) && isellipsis(cadr(ls))))
+                return subst(ls, b, renames, 0);
+        name = subst(car(car(ls)), b, inner, 0);
+        val = subst(cdr(car(ls)), b, renames, 0);
+        rest = substbinds(cdr(ls), b, renames, inner);
+        if (name == NULL || val == NULL || rest == NULL)
+                return NULL;
+        return cons(cons(name, val), rest);
+}
+
+SExp *patvars(SExp *pat, SExp *lits, SExp *vars) {
+        if (compound(pat))
+                return patvars(cdr(pat), lits, patvars(car(pat), lits, vars));
+        if (!atomic(pat) || isellipsis(pat) || eqsym(pat, "_")
+                        || inscope(pat, lits) || inscope(pat, vars))
+                return vars;
+        return cons(pat, vars);
+}
+
+SExp *seqvars(SExp *t, SExp *b, SExp *vars) {
+        SExp *kv;
+
+        if (compound(t))
+                return seqvars(cdr(t), b, seqvars(car(t), b, vars));
+        if (!atomic(t) || inscope(t, vars))
+                return vars;
+        kv = binding(t, b);
+        if (kv == NULL || !isseq(cdr(kv)))
+                return vars;
+        return cons(t, vars);
+}
+
+/* Pick fresh names for the variables defined in the template body t,
+ * other than pattern variables. Lambdas and lets are scopes of their
+ * own, see subst(). */
+SExp *binders(SExp *t, SExp *b, SExp *renames) {
+        if (!compound(t) || tagged(t, "quote")
+                        || tagged(t, "lambda") || tagged(t, "let"))
+                return renames;
+        if (tagged(t, "define") && compound(cdr(t))) {
+                /* (define name ...) or (define (name params) ...) */
+                if (compound(cadr(t)))
+                        return fresh(car(cadr(t)), b, renames);
+                renames = fresh(cadr(t), b, renames);
+        }
+        for (; compound(t); t = cdr(t))
+                renames = binders(car(t), b, renames);
+        return renames;
+}
+
+/* Pick fresh names for the parameters in ls. */
+SExp *freshparams(SExp *ls, SExp *b, SExp *renames) {
+        for (; compound(ls); ls = cdr(ls))
+                renames = fresh(car(ls), b, renames);
+        return fresh(ls, b, renames);
+}
+
+SExp *fresh(SExp *var, SExp *b, SExp *renames) {
+        if (!atomic(var) || isellipsis(var) || binding(var, b) != NULL
+                        || binding(var, renames) != NULL)
+                return renames;
+        return cons(cons(var, gensym(var)), renames);
+}
+
+/* Renamed variables contain a space, so they can't clash with anything
+ * the reader produces. */
+SExp *gensym(SExp *var) {
+        snprintf(buf, BUFLEN, "%.*s %d", box(var)->len, symname(var), ++gensyms);
+        return mkatom(buf);
+}
+
+/* Special forms can't be rebound, so templates keep them as they are. */
+int keyword(SExp *var) {
+        static char *keywords[] = {
+                "quote", "if", "lambda", "define", "set!", "begin",
+                "load-data", "define-syntax", "syntax-rules", NULL
+        };
+        int i;
+
+        for (i = 0; keywords[i] != NULL; i++) {
+                if (eqsym(var, keywords[i]))
+                        return 1;
+        }
+        return 0;
+}
+
+SExp *binding(SExp *var, SExp *b) {
+        for (; b != nil; b = cdr(b)) {
+                if (samesym(var, car(car(b))))
+                        return car(b);
+        }
+        return NULL;
+}
+
+int isellipsis(SExp *exp) {
+        return atomic(exp) && eqsym(exp, "...");
+}
+
+int isseq(SExp *exp) {
+        return compound(exp) && car(exp) == ellipsis;
+}
+
+/* Rewrite exp ahead of evaluation: fold constant expressions, inline
+ * calls to primitives and drop if branches that can never be taken.
+ * scope lists the variables bound locally around exp, which shadow
+ * any global of the same name. */
+SExp *optimize(SExp *exp, SExp *scope) {
+        if (atomic(exp) && !inscope(exp, scope))
+                return cons(GLOBAL, cons(nil, exp));
+        if (globalref(exp))
+                return exp;
+        if (!compound(exp) || tagged(exp, "quote") || tagged(exp, "load-data"))
+                return exp;
+        if (tagged(exp, "lambda")) {
+                if (length(exp) != 3)
+                        return exp;
+                return cons(car(exp), cons(cadr(exp),
+                        cons(optbody(caddr(exp), cadr(exp), scope), nil)));
+        }
+        if (tagged(exp, "define")) {
+                if (length(exp) != 3)
+                        return exp;
+                if (compound(cadr(exp)))
+                        return cons(car(exp), cons(cadr(exp),
+                                cons(optbody(caddr(exp), cdr(cadr(exp)), scope), nil)));
+                return cons(car(exp), cons(cadr(exp),
+                        cons(optimize(caddr(exp), scope), nil)));
+        }
+        if (tagged(exp, "if"))
+                return optif(exp, scope);
+        if (tagged(exp, "set!") && length(exp) == 3)
+                return cons(car(exp), cons(cadr(exp), optlist(cddr(exp), scope)));
+        if (tagged(exp, "set!") || tagged(exp, "begin"))
+                return cons(car(exp), optlist(cdr(exp), scope));
+        return optcall(exp, scope);
+}
+
+SExp *optlist(SExp *ls, SExp *scope) {
+        if (!compound(ls))
+                return ls;
+        return cons(optimize(car(ls), scope), optlist(cdr(ls), scope));
+}
+
+/* Optimize a procedure body, with its parameters and internal defines
+ * shadowing globals. */
+SExp *optbody(SExp *body, SExp *params, SExp *scope) {
+        scope = bindparams(params, scope);
+        return optimize(body, defines(body, scope));
+}
+
+/* (if c1 a1 a2) */
+SExp *optif(SExp *exp, SExp *scope) {
+        SExp *predicate;
+
+        if (length(exp) != 4)
+                return exp;
+        predicate = optimize(cadr(exp), scope);
+        if (predicate == NULL)
+                return NULL;
+        if (tagged(predicate, "quote")
+                        || (!atomic(predicate) && !compound(predicate)))
+                return optimize(predicate == false ? cadddr(exp) : caddr(exp), scope);
+        return cons(car(exp), cons(predicate, optlist(cddr(exp), scope)));
+}
+
+/* Calls to a global primitive become (<prim> <cell> <value> . args),
+ * see evalprim(). Calls with constant arguments are folded into
+ * <value>; both stay guarded by <cell> in case the global is redefined
+ * by define or set!. */
+SExp *optcall(SExp *exp, SExp *scope) {
+        SExp *op, *var, *cell, *args, *value = nil, *ls;
+
+        op = car(exp);
+        args = optlist(cdr(exp), scope);
+        if (args == NULL)
+                return NULL;
+        if (globalref(op))
+                var = cddr(op);
+        else if (atomic(op) && !inscope(op, scope))
+                var = op;
+        else
+                return cons(optimize(op, scope), args);
+        cell = globalcell(var);
+        if (cell == NULL || !inlinable(car(cell), args))
+                return cons(optimize(op, scope), args);
+        for (ls = args; ls != nil && constant(car(ls)); ls = cdr(ls))
+                ;
+        if (ls == nil) {
+                value = evalop(box(car(cell))->op, args, nil);
+                if (value == NULL) {
+                        /* leave the error for run time */
+                        err = NULL;
+                        value = nil;
+                }
+        }
+        return cons(car(cell), cons(cell, cons(value, args)));
+}
+
+/* Collect the variables defined anywhere within exp onto scope. */
+SExp *defines(SExp *exp, SExp *scope) {
+        if (!compound(exp) || tagged(exp, "quote"))
+                return scope;
+        if (tagged(exp, "define") && length(exp) == 3)
+                scope = cons(compound(cadr(exp)) ? car(cadr(exp)) : cadr(exp), scope);
+        for (; compound(exp); exp = cdr(exp))
+                scope = defines(car(exp), scope);
+        return scope;
+}
+
+SExp *bindparams(SExp *params, SExp *scope) {
+        for (; compound(params); params = cdr(params))
+                scope = cons(car(params), scope);
+        if (atomic(params))
+                scope = cons(params, scope);
+        return scope;
+}
+
+
+int inscope(SExp *var, SExp *scope) {
+        for (; scope != nil; scope = cdr(scope)) {
+                if (atomic(car(scope)) && samesym(var, car(scope)))
+                        return 1;
+        }
+        return 0;
+}
+
+int inlinable(SExp *prim, SExp *args) {
+        if (!primproc(prim) || box(prim)->op == OP_NONE)
+                return 0;
+        if (box(prim)->op == OP_CAR || box(prim)->op == OP_CDR)
+                return length(args) == 1;
+        return args != nil;
+}
+
+int inlined(SExp *exp) {
+        return compound(exp) && primproc(car(exp));
+}
+
+int globalref(SExp *exp) {
+        return compound(exp) && car(exp) == GLOBAL;
+}
+
+/* An inlined call holds while its global still names the primitive it
+ * was built from, and a folded one while its folded arguments do too. */
+int intact(SExp *exp) {
+        SExp *args;
+
+        if (car(cadr(exp)) != car(exp))
+                return 0;
+        if (caddr(exp) == nil)
+                return 1;
+        for (args = cdddr(exp); args != nil; args = cdr(args)) {
+                if (inlined(car(args)) && !intact(car(args)))
+                        return 0;
+        }
+        return 1;
+}
+
+int constant(SExp *exp) {
+        return number(exp) || (inlined(exp) && caddr(exp) != nil);
+}
+
+/* Call f on the arguments, running compiled tail calls in a loop so
+ * they don't grow the C stack. */
+SExp *callc(SExp *f, int argc, SExp **argv) {
+        SExp *result;
+        int base = sp;
+
+        if (depth == MAXDEPTH) {
+                seterr("recursion too deep");
+                return NULL;
+        }
+        /* keep the procedure on the stack, tail calls replace it */
+        if (push(f) == NULL)
+                return NULL;
+        depth++;
+        while (1) {
+                f = stack[base];
+                if (!compiled(f)) {
+                        result = apply(f, argc, argv);
+                        break;
+                }
+                result = box(car(f))->code(cdr(f), argc, argv);
+                if (result != TAIL)
+                        break;
+                /* move the tail call's arguments down over the last ones */
+                stack[base] = tailf;
+                argc = tailargc;
+                memmove(&stack[base+1], &stack[sp-argc], argc * sizeof(SExp *));
+                sp = base + 1 + argc;
+                argv = &stack[base+1];
+        }
+        sp = base;
+        depth--;
+        return result;
+}
+
+/* Leave a tail call for callc(), with its arguments on the stack. */
+SExp *tailcall(SExp *f, int argc, SExp **argv) {
+        int i;
+
+        for (i = 0; i < argc; i++) {
+                if (push(argv[i]) == NULL)
+                        return NULL;
+        }
+        tailf = f;
+        tailargc = argc;
+        return TAIL;
+}
+
+/* The environment for a call to a compiled procedure. Its frame is a
+ * list of the arguments, followed by a slot for each internal define. */
+SExp *mkframe(int argc, SExp **argv, int nparams, int rest, int ndefs, SExp *env) {
+        SExp *vals = nil;
+
+        for (; ndefs > 0; ndefs--)
+                vals = cons(unbound, vals);
+        return cons(bindargs(argc, argv, nparams, rest, vals), env);
+}
+
+SExp **slot(SExp *env, int depth, int index) {
+        SExp *frame;
+
+        for (; depth > 0; depth--)
+                env = cdr(env);
+        for (frame = car(env); index > 0; index--)
+                frame = cdr(frame);
+        return &car(frame);
+}
+
+/* The global binding of var, remembered in *cache once it exists. */
+SExp *gcell(SExp **cache, SExp *var) {
+        if (*cache == NULL)
+                *cache = globalcell(var);
+        return *cache;
+}
+
+SExp *gref(SExp **cache, SExp *var) {
+        if (gcell(cache, var) == NULL) {
+                seterr("undefined variable");
+                return NULL;
+        }
+        return car(*cache);
+}
+
+SExp *gset(SExp **cache, SExp *var, SExp *val) {
+        if (gcell(cache, var) == NULL) {
+                seterr("undefined variable");
+                return NULL;
+        }
+        car(*cache) = val;
+        return mkatom("ok");
+}
+
+int compiled(SExp *exp) {
+        return compound(exp) && isbox(car(exp)) && box(car(exp))->type == CODE;
+}
+
+int atomic(SExp *exp) {
+        return isbox(exp) && box(exp)->type == ATOM;
+}
+
+int compound(SExp *exp) {
+        return ispair(exp);
+}
+
+int empty(SExp *exp) {
+        return exp == nil;
+}
+
+int primproc(SExp *exp) {
+        return isbox(exp) && box(exp)->type == PRIM;
+}
+
+int number(SExp *exp) {
+        return isfix(exp);
+}
+
+int numeric(char *s, int len) {
+        int i = 0;
+
+        if (len > 0 && s[0] == '-')
+                i++;
+        if (i == len)
+                return 0;
+        for (; i < len; i++) {
+                if (!isdigit(s[i]))
+                        return 0;
+        }
+        return 1;
+}
+
+long tonum(char *s, int len) {
+        long n = 0;
+        int i;
+
+        for (i = s[0] == '-'; i < len; i++)
+                n = n * 10 + s[i] - '0';
+        return s[0] == '-' ? -n : n;
+}
+
+int tagged(SExp *ls, char *tag) {
+        return compound(ls) && atomic(car(ls)) && eqsym(car(ls), tag);
+}
+
+void print(SExp *exp) {
+        if (atomic(exp)) {
+                printf("%.*s", box(exp)->len, symname(exp));
+        } else if (number(exp)) {
+                printf("%ld", fixval(exp));
+        } else if (empty(exp)) {
+                printf("()");
+        } else if (exp == true) {
+                printf("#t");
+        } else if (exp == false) {
+                printf("#f");
+        } else if (compound(exp)) {
+                if (tagged(exp, "proc") || compiled(exp)) {
+                        printf("PROC");
+                } else {
+                        printf("(");
+                        print(car(exp));
+                        printf(".");
+                        print(cdr(exp));
+                        printf(")");
+                }
+        } else if (primproc(exp)) {
+                printf("<built-in>");
+        }
+}
+
+/* Map path and read every datum in it into DATA slabs, returning them
+ * as a list. Atoms point straight into the mapping, which is never
+ * unmapped. */
+SExp *loaddata(char *path) {
+        struct stat st;
+        char *p, *end;
+        SExp *head = nil, *tail = NULL, *exp, *pair;
+        int fd;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                seterr("can't open data file");
+                return NULL;
+        }
+        if (fstat(fd, &st) < 0 || st.st_size == 0) {
+                close(fd);
+                return nil;
+        }
+        p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+                seterr("can't map data file");
+                return NULL;
+        }
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+        end = p + st.st_size;
+        while (1) {
+                while (p < end && isspace(*p))
+                        p++;
+                if (p == end)
+                        break;
+                exp = readdata(&p, end);
+                pair = datacell();
+                if (exp == NULL || pair == NULL)
+                        return NULL;
+                car(pair) = exp;
+                cdr(pair) = nil;
+                if (tail == NULL)
+                        head = pair;
+                else
+                        cdr(tail) = pair;
+                tail = pair;
+        }
+        return head;
+}
+
+/* Read the datum at *p, advancing *p past it. Lists are read in a loop
+ * rather than by recursing on the cdr like parse(), since data files
+ * can hold very long ones. */
+SExp *readdata(char **p, char *end) {
+        SExp *head = nil, *tail = NULL, *exp, *pair;
+        char *s;
+
+        while (*p < end && isspace(**p))
+                (*p)++;
+        if (*p == end) {
+                seterr("unexpected end of data");
+                return NULL;
+        }
+        s = (*p)++;
+        if (*s == ')') {
+                seterr("unexpected close paren");
+                return NULL;
+        }
+        if (*s == '\'') {
+                exp = readdata(p, end);
+                if (exp == NULL)
+                        return NULL;
+                pair = datacell();
+                head = datacell();
+                if (pair == NULL || head == NULL)
+                        return NULL;
+                car(pair) = exp;
+                cdr(pair) = nil;
+                car(head) = mkdata("quote", 5);
+                cdr(head) = pair;
+                return car(head) == NULL ? NULL : head;
+        }
+        if (*s == '(') {
+                while (1) {
+                        while (*p < end && isspace(**p))
+                                (*p)++;
+                        if (*p == end) {
+                                seterr("unexpected end of data");
+                                return NULL;
+                        }
+                        if (**p == ')') {
+                                (*p)++;
+                                return head;
+                        }
+                        if (**p == '.' && (*p + 1 == end || isspace((*p)[1])
+                                                || isreserved((*p)[1])))
+                                return readtail(p, end, head, tail);
+                        exp = readdata(p, end);
+                        pair = datacell();
+                        if (exp == NULL || pair == NULL)
+                                return NULL;
+                        car(pair) = exp;
+                        cdr(pair) = nil;
+                        if (tail == NULL)
+                                head = pair;
+                        else
+                                cdr(tail) = pair;
+                        tail = pair;
+                }
+        }
+        while (*p < end && !isreserved(**p) && !isspace(**p))
+                (*p)++;
+        if (numeric(s, *p - s))
+                return mknum(tonum(s, *p - s));
+        return mkdata(s, *p - s);
+}
+
+/* The datum after the dot of a dotted list, which must end the list,
+ * like parse(). */
+SExp *readtail(char **p, char *end, SExp *head, SExp *tail) {
+        SExp *exp;
+
+        (*p)++;
+        exp = readdata(p, end);
+        if (exp == NULL)
+                return NULL;
+        while (*p < end && isspace(**p))
+                (*p)++;
+        if (*p == end || **p != ')') {
+                seterr("malformed dotted list");
+                return NULL;
+        }
+        (*p)++;
+        if (tail == NULL)
+                return exp;
+        cdr(tail) = exp;
+        return head;
+}
+
+int readtoken(FILE *f) {
+        char c;
+        int i;
+
+        while (1) {
+                c = getc(f);
+                if (c == EOF)
+                        return END;
+                if (isspace(c))
+                        continue;
+                if (c == '(')
+                        return LPAREN;
+                if (c == ')')
+                        return RPAREN;
+                if (c == '\'')
+                        return QUOTE;
+                break;
+        }
+        for (i = 0; i < BUFLEN-1; i++) {
+                buf[i] = c;
+                c = getc(f);
+                if (c == EOF)
+                        return END;
+                if (isreserved(c) || isspace(c))
+                        break;
+        }
+        buf[i+1] = '\0';
+        if (isreserved(c))
+                ungetc(c, f);
+        return SYM;
+}
+
+void seterr(char *msg) {
+        if (err == NULL)
+                err = msg;
+}
+
+SExp *alloc(void) {
+        SExp *exp;
+
+        if (freecells == NULL && newslab(PAIRS) == NULL)
+                return NULL;
+        exp = freecells;
+        freecells = cdr(exp);
+        return exp;
+}
+
+Box *allocbox(void) {
+        Box *b;
+
+        if (freeboxes == NULL && newslab(BOXES) == NULL)
+                return NULL;
+        b = freeboxes;
+        freeboxes = b->next;
+        return b;
+}
+
+/* Allocate a slab and put its slots on the free list. */
+Slab *newslab(int kind) {
+        Slab *slab;
+        SExp *slots;
+        Box *b;
+        size_t i;
+
+        if (nslabs == MAXSLABS) {
+                seterr("out of nodes");
+                return NULL;
+        }
+        slab = aligned_alloc(SLABSIZE, SLABSIZE);
+        if (slab == NULL) {
+                seterr("malloc failed");
+                return NULL;
+        }
+        memset(slab, 0, SLABSIZE);
+        slab->kind = kind;
+        slab->next = slabs;
+        slabs = slab;
+        nslabs++;
+        if (nslabs >= gclimit)
+                gcneeded = 1;
+        slots = (SExp *)slab;
+        for (i = FIRSTSLOT; i < NSLOTS; i++) {
+                if (kind == BOXES) {
+                        b = (Box *)&slots[i];
+                        b->type = FREE;
+                        b->next = freeboxes;
+                        freeboxes = b;
+                } else {
+                        cdr(&slots[i]) = freecells;
+                        freecells = &slots[i];
+                }
+        }
+        return slab;
+}
+
+/* Take the next slot of the DATA slab. DATA slabs aren't on the slabs
+ * list, and live as long as the interpreter. */
+SExp *datacell(void) {
+        if (dataslab == NULL || datanext == NSLOTS) {
+                dataslab = aligned_alloc(SLABSIZE, SLABSIZE);
+                if (dataslab == NULL) {
+                        seterr("malloc failed");
+                        return NULL;
+                }
+                memset(dataslab, 0, sizeof(Slab));
+                dataslab->kind = DATA;
+                datanext = FIRSTSLOT;
+        }
+        return &((SExp *)dataslab)[datanext++];
+}
+
+/* Mark everything reachable from exp. Pairs are marked first and
+ * scanned later from markstack, so deep structures don't recurse. If
+ * markstack fills up, the pairs that didn't fit are found again by
+ * rescanning the heap. */
+void mark(SExp *exp) {
+        markone(exp);
+        while (marksp > 0 || markoverflow) {
+                if (marksp == 0) {
+                        rescan();
+                        continue;
+                }
+                exp = markstack[--marksp];
+                markone(cdr(exp));
+                markone(car(exp));
+        }
+}
+
+void markone(SExp *exp) {
+        Slab *slab;
+        unsigned long bit;
+        size_t i;
+
+        if (!compound(exp) && !isbox(exp))
+                return;
+        slab = slabof(exp);
+        if (slab->kind == DATA)
+                return;
+        i = slotof(exp);
+        bit = 1UL << (i % LONGBITS);
+        if (slab->marks[i / LONGBITS] & bit)
+                return;
+        slab->marks[i / LONGBITS] |= bit;
+        if (!compound(exp))
+                return;
+        if (marksp == MARKLEN)
+                markoverflow = 1;
+        else
+                markstack[marksp++] = exp;
+}
+
+/* Scan the children of every marked pair, after markstack overflowed. */
+void rescan(void) {
+        Slab *slab;
+        SExp *slots;
+        size_t i;
+
+        markoverflow = 0;
+        for (slab = slabs; slab != NULL; slab = slab->next) {
+                if (slab->kind != PAIRS)
+                        continue;
+                slots = (SExp *)slab;
+                for (i = FIRSTSLOT; i < NSLOTS; i++) {
+                        if (slab->marks[i / LONGBITS] & (1UL << (i % LONGBITS))) {
+                                markone(car(&slots[i]));
+                                markone(cdr(&slots[i]));
+                        }
+                }
+        }
+}
+
+/* Rebuild the free lists from every unmarked slot, and clear the marks
+ * for the next collection. */
+void sweep(void) {
+        Slab *slab;
+        SExp *slots;
+        Box *b;
+        size_t i;
+        int live = 0;
+
+        freecells = NULL;
+        freeboxes = NULL;
+        for (slab = slabs; slab != NULL; slab = slab->next) {
+                slots = (SExp *)slab;
+                for (i = FIRSTSLOT; i < NSLOTS; i++) {
+                        if (slab->marks[i / LONGBITS] & (1UL << (i % LONGBITS))) {
+                                live++;
+                        } else if (slab->kind == BOXES) {
+                                b = (Box *)&slots[i];
+                                if (b->type == ATOM)
+                                        free(b->atom);
+                                b->type = FREE;
+                                b->next = freeboxes;
+                                freeboxes = b;
+                        } else {
+                                cdr(&slots[i]) = freecells;
+                                freecells = &slots[i];
+                        }
+                }
+                memset(slab->marks, 0, sizeof(slab->marks));
+        }
+        gclimit = 2 * live / (NSLOTS - FIRSTSLOT) + 16;
         if (verbose)
-                fprintf(stderr, "%d living nodes\n", counter);
+                fprintf(stderr, "%d living nodes\n", live);
 }
 
-int main(void) {
-        SExp *input, *result;
+char *opnames[] = {
+        "OP_NONE", "OP_ADD", "OP_SUB", "OP_MULT", "OP_DIV",
+        "OP_LT", "OP_GT", "OP_LTE", "OP_GTE", "OP_EQL", "OP_CAR", "OP_CDR"
+};
+char *cops[] = {"", "+", "-", "*", "/", "<", ">", "<=", ">=", "=="};
+
+/* Compile the program on in to C on out, to be linked with runtime.o.
+ * Each top-level form and each lambda becomes a C function. Values
+ * live in the function's r[] temporaries, which are registered with
+ * the collector, and the collector only runs on entry to a procedure,
+ * so nothing else needs rooting. Tail calls return to callc(). */
+int compile(FILE *in, FILE *out) {
+        SExp *exp;
+        char *functext, *inittext;
+        size_t funcsize, initsize;
+        int i;
 
         init();
+        cfuncs = open_memstream(&functext, &funcsize);
+        cinit = open_memstream(&inittext, &initsize);
+        if (cfuncs == NULL || cinit == NULL)
+                return 1;
+        csyms = nil;
+        ccells = nil;
         while (!eof) {
-                input = parse(stdin, 0);
-                if (input != NULL) {
-                        result = eval(input, global);
-                        if (result != NULL) {
-                                print(result);
-                                printf("\n");
-                        }
+                exp = parse(in, 0);
+                if (exp != NULL)
+                        exp = expand(exp, nil);
+                if (exp != NULL)
+                        exp = optimize(exp, nil);
+                if (exp != NULL)
+                        compform(exp);
+                if (err != NULL) {
+                        /* report it when the program gets there, as sexp would */
+                        fprintf(cfuncs, "static SExp *form%d(void) {\n", nforms++);
+                        fprintf(cfuncs, "        seterr(\"%s\");\n", err);
+                        fprintf(cfuncs, "        return NULL;\n}\n\n");
+                        err = NULL;
+                }
+        }
+        fclose(cfuncs);
+        fclose(cinit);
+        fprintf(out, "/* compiled by sexp -c */\n#include \"sexp.h\"\n\n");
+        fprintf(out, "static SExp *k[%d]; /* constants */\n", nconsts + 1);
+        fprintf(out, "static SExp *c[%d]; /* global bindings */\n\n", ncells + 1);
+        fwrite(functext, 1, funcsize, out);
+        fprintf(out, "int main(void) {\n");
+        fprintf(out, "        static Frame constants = {NULL, %d, k};\n", nconsts + 1);
+        fprintf(out, "        static SExp *(*forms[])(void) = {");
+        for (i = 0; i < nforms; i++)
+                fprintf(out, "form%d, ", i);
+        fprintf(out, "NULL};\n        int i;\n\n        init();\n");
+        fprintf(out, "        constants.prev = frames;\n        frames = &constants;\n");
+        fwrite(inittext, 1, initsize, out);
+        fprintf(out, "        for (i = 0; forms[i] != NULL; i++)\n");
+        fprintf(out, "                report(forms[i]());\n");
+        fprintf(out, "        return 0;\n}\n");
+        free(functext);
+        free(inittext);
+        return 0;
+}
+
+int compform(SExp *exp) {
+        Comp c;
+
+        opencomp(&c, 0);
+        emit(&c, "r[0] = nil;");
+        if (!compexp(&c, exp, nil, 1, 1)) {
+                fclose(c.out);
+                free(c.text);
+                return -1;
+        }
+        closecomp(&c, "static SExp *form%d(void)", nforms);
+        return nforms++;
+}
+
+/* Compile a lambda. Its environment is a list of frames, each holding
+ * the values of (nparams . names) in the compile time scope. */
+int compfunc(SExp *params, SExp *body, SExp *scope) {
+        Comp c;
+        SExp *names, *all, *ls, *defs = nil;
+        int nparams = 0, rest, ndefs, fn = nfuncs++;
+
+        for (ls = params; compound(ls); ls = cdr(ls))
+                nparams++;
+        rest = ls != nil;
+        names = paramlist(params);
+        all = localdefs(body, names);
+        for (ndefs = length(all) - length(names); ndefs > 0; ndefs--) {
+                defs = cons(car(all), defs);
+                all = cdr(all);
+        }
+        opencomp(&c, 1);
+        emit(&c, "r[0] = mkframe(argc, argv, %d, %d, %d, env);", nparams, rest,
+                        length(defs));
+        emitcheck(&c, 0);
+        emit(&c, "if (gcneeded)");
+        emit(&c, "        gc();");
+        scope = cons(cons(mknum(nparams + rest), append(names, defs)), scope);
+        if (!compexp(&c, body, scope, 1, 1)) {
+                fclose(c.out);
+                free(c.text);
+                return -1;
+        }
+        closecomp(&c, "static SExp *fn%d(SExp *env, int argc, SExp **argv)", fn);
+        return fn;
+}
+
+/* Emit code leaving the value of exp in r[dst], returning it if tail is
+ * set. Returns 0 on error. */
+int compexp(Comp *c, SExp *exp, SExp *scope, int dst, int tail) {
+        int ok = 1;
+
+        if (dst + 1 > c->temps)
+                c->temps = dst + 1;
+        if (atomic(exp)) {
+                ok = compref(c, exp, scope, dst);
+        } else if (globalref(exp)) {
+                ok = compref(c, exp, scope, dst);
+        } else if (number(exp)) {
+                emit(c, "r[%d] = mknum(%ldL);", dst, fixval(exp));
+        } else if (!compound(exp)) {
+                emit(c, "r[%d] = %s;", dst, exp == true ? "true" :
+                                exp == false ? "false" : "nil");
+        } else if (inlined(exp)) {
+                ok = compprim(c, exp, scope, dst);
+        } else if (tagged(exp, "quote")) {
+                if (compound(cadr(exp)) || atomic(cadr(exp)))
+                        emit(c, "r[%d] = k[%d];", dst, dataconst(cadr(exp)));
+                else
+                        return compexp(c, cadr(exp), scope, dst, tail);
+        } else if (tagged(exp, "if")) {
+                return compif(c, exp, scope, dst, tail);
+        } else if (tagged(exp, "lambda")) {
+                if (length(exp) != 3) {
+                        seterr("malformed lambda statement");
+                        return 0;
+                }
+                ok = complambda(c, cadr(exp), caddr(exp), scope, dst);
+        } else if (tagged(exp, "define")) {
+                ok = compdefine(c, exp, scope, dst);
+        } else if (tagged(exp, "set!")) {
+                if (length(exp) != 3 || !(atomic(cadr(exp)) || globalref(cadr(exp)))) {
+                        seterr("malformed set! statement");
+                        return 0;
+                }
+                ok = compexp(c, caddr(exp), scope, dst, 0)
+                        && compset(c, cadr(exp), scope, dst);
+        } else if (tagged(exp, "begin")) {
+                return compbegin(c, exp, scope, dst, tail);
+        } else if (tagged(exp, "load-data")) {
+                emit(c, "r[%d] = evalloaddata(k[%d], nil);", dst, dataconst(exp));
+                emitcheck(c, dst);
+        } else {
+                return compcall(c, exp, scope, dst, tail);
+        }
+        if (ok && tail)
+                emitreturn(c, dst);
+        return ok;
+}
+
+int compref(Comp *c, SExp *var, SExp *scope, int dst) {
+        int kind, depth, index;
+
+        kind = globalref(var) ? 0 : resolve(var, scope, &depth, &index);
+        if (kind == 0) {
+                if (globalref(var))
+                        var = cddr(var);
+                emit(c, "r[%d] = gref(&c[%d], k[%d]);", dst, cellindex(var),
+                                symconst(var));
+                emitcheck(c, dst);
+                return 1;
+        }
+        emit(c, "r[%d] = *slot(r[0], %d, %d);", dst, depth, index);
+        if (kind == 2) {
+                emit(c, "if (r[%d] == unbound) {", dst);
+                emit(c, "        seterr(\"undefined variable\");");
+                emit(c, "        goto fail;");
+                emit(c, "}");
+                c->fails = 1;
+        }
+        return 1;
+}
+
+/* An inlined primitive call, see evalprim(). Two fixnum arguments are
+ * handled in place. */
+int compprim(Comp *c, SExp *exp, SExp *scope, int dst) {
+        SExp *var, *args;
+        int op, n, cell, prim, sym, a = dst + 1;
+
+        op = box(car(exp))->op;
+        var = cdr(cadr(exp));
+        args = cdddr(exp);
+        n = length(args);
+        if (!compargs(c, args, scope, a))
+                return 0;
+        cell = cellindex(var);
+        sym = symconst(var);
+        prim = nconsts++;
+        fprintf(cinit, "        k[%d] = gref(&c[%d], k[%d]);\n", prim, cell, sym);
+        emit(c, "if (car(c[%d]) == k[%d]) {", cell, prim);
+        c->indent++;
+        if (n == 2 && (iscmp(op) || (isarith(op) && op != OP_DIV))) {
+                emit(c, "if (isfix(r[%d]) && isfix(r[%d]))", a, a + 1);
+                if (iscmp(op))
+                        emit(c, "        r[%d] = fixval(r[%d]) %s fixval(r[%d]) ? true : false;",
+                                        dst, a, cops[op], a + 1);
+                else
+                        emit(c, "        r[%d] = mknum(fixval(r[%d]) %s fixval(r[%d]));",
+                                        dst, a, cops[op], a + 1);
+                emit(c, "else");
+                emit(c, "        r[%d] = primop(%s, 2, &r[%d]);", dst, opnames[op], a);
+        } else if (op == OP_CAR || op == OP_CDR) {
+                emit(c, "r[%d] = ispair(r[%d]) ? %s(r[%d]) : primop(%s, 1, &r[%d]);",
+                                dst, a, op == OP_CAR ? "car" : "cdr", a, opnames[op], a);
+        } else {
+                emit(c, "r[%d] = primop(%s, %d, &r[%d]);", dst, opnames[op], n, a);
+        }
+        c->indent--;
+        emit(c, "} else {");
+        emit(c, "        r[%d] = callc(car(c[%d]), %d, &r[%d]);", dst, cell, n, a);
+        emit(c, "}");
+        emitcheck(c, dst);
+        return 1;
+}
+
+/* (if c1 a1 a2) */
+int compif(Comp *c, SExp *exp, SExp *scope, int dst, int tail) {
+        if (length(exp) != 4) {
+                seterr("malformed if statement");
+                return 0;
+        }
+        if (!compexp(c, cadr(exp), scope, dst, 0))
+                return 0;
+        emit(c, "if (r[%d] != false) {", dst);
+        c->indent++;
+        if (!compexp(c, caddr(exp), scope, dst, tail))
+                return 0;
+        c->indent--;
+        emit(c, "} else {");
+        c->indent++;
+        if (!compexp(c, cadddr(exp), scope, dst, tail))
+                return 0;
+        c->indent--;
+        emit(c, "}");
+        return 1;
+}
+
+int complambda(Comp *c, SExp *params, SExp *body, SExp *scope, int dst) {
+        SExp *ls;
+        int fn, code;
+
+        for (ls = params; compound(ls); ls = cdr(ls)) {
+                if (!atomic(car(ls)))
+                        break;
+        }
+        if (ls != nil && !atomic(ls)) {
+                seterr("malformed lambda statement");
+                return 0;
+        }
+        fn = compfunc(params, body, scope);
+        if (fn < 0)
+                return 0;
+        code = nconsts++;
+        fprintf(cinit, "        k[%d] = mkcode(fn%d);\n", code, fn);
+        emit(c, "r[%d] = cons(k[%d], r[0]);", dst, code);
+        emitcheck(c, dst);
+        return 1;
+}
+
+/* (define symbol value)
+ * OR (define (symbol params) body) */
+int compdefine(Comp *c, SExp *exp, SExp *scope, int dst) {
+        SExp *var;
+        int ok, depth, index;
+
+        if (length(exp) != 3) {
+                seterr("malformed define statement");
+                return 0;
+        }
+        if (compound(cadr(exp))) {
+                var = car(cadr(exp));
+                ok = complambda(c, cdr(cadr(exp)), caddr(exp), scope, dst);
+        } else {
+                var = cadr(exp);
+                ok = compexp(c, caddr(exp), scope, dst, 0);
+        }
+        if (!ok)
+                return 0;
+        if (!atomic(var)) {
+                seterr("malformed define statement");
+                return 0;
+        }
+        if (resolve(var, scope, &depth, &index) == 0) {
+                emit(c, "r[%d] = globalbind(k[%d], r[%d]);", dst,
+                                symconst(var), dst);
+                emitcheck(c, dst);
+                return 1;
+        }
+        emit(c, "*slot(r[0], %d, %d) = r[%d];", depth, index, dst);
+        emit(c, "r[%d] = k[%d];", dst, symconst(mkatom("ok")));
+        return 1;
+}
+
+/* (set! symbol value), with the value in r[dst] */
+int compset(Comp *c, SExp *var, SExp *scope, int dst) {
+        int depth, index;
+
+        if (globalref(var) || resolve(var, scope, &depth, &index) == 0) {
+                if (globalref(var))
+                        var = cddr(var);
+                emit(c, "r[%d] = gset(&c[%d], k[%d], r[%d]);", dst,
+                                cellindex(var), symconst(var), dst);
+                emitcheck(c, dst);
+                return 1;
+        }
+        emit(c, "*slot(r[0], %d, %d) = r[%d];", depth, index, dst);
+        emit(c, "r[%d] = k[%d];", dst, symconst(mkatom("ok")));
+        return 1;
+}
+
+/* (begin e1 e2 e3 ...) */
+int compbegin(Comp *c, SExp *exp, SExp *scope, int dst, int tail) {
+        SExp *seq;
+
+        if (cdr(exp) == nil)
+                return compexp(c, nil, scope, dst, tail);
+        for (seq = cdr(exp); seq != nil; seq = cdr(seq)) {
+                if (!compexp(c, car(seq), scope, dst, tail && cdr(seq) == nil))
+                        return 0;
+        }
+        return 1;
+}
+
+/* The arguments are passed in place as &r[dst+1], tail calls copy them
+ * to the stack. */
+int compcall(Comp *c, SExp *exp, SExp *scope, int dst, int tail) {
+        int n = length(cdr(exp)), a = dst + 1;
+
+        if (!compexp(c, car(exp), scope, dst, 0) || !compargs(c, cdr(exp), scope, a))
+                return 0;
+        if (tail && c->proc) {
+                emit(c, "r[%d] = tailcall(r[%d], %d, &r[%d]);", dst, dst, n, a);
+                emitcheck(c, dst);
+                emitreturn(c, dst);
+                return 1;
+        }
+        emit(c, "r[%d] = callc(r[%d], %d, &r[%d]);", dst, dst, n, a);
+        emitcheck(c, dst);
+        if (tail)
+                emitreturn(c, dst);
+        return 1;
+}
+
+/* Evaluate args into r[dst], r[dst+1], ... */
+int compargs(Comp *c, SExp *args, SExp *scope, int dst) {
+        for (; args != nil; args = cdr(args), dst++) {
+                if (!compexp(c, car(args), scope, dst, 0))
+                        return 0;
+        }
+        return 1;
+}
+
+/* Find var in the compile time scope. Returns 0 for globals, 1 for
+ * parameters and 2 for internal defines, which may not have run. */
+int resolve(SExp *var, SExp *scope, int *depth, int *index) {
+        SExp *names;
+
+        for (*depth = 0; scope != nil; scope = cdr(scope), (*depth)++) {
+                names = cdr(car(scope));
+                for (*index = 0; names != nil; names = cdr(names), (*index)++) {
+                        if (samesym(var, car(names)))
+                                return *index < fixval(car(car(scope))) ? 1 : 2;
                 }
-                if (err != NULL)
-                        fprintf(stderr, "Error: %s\n", err);
-                err = NULL;
-                gc();
+        }
+        return 0;
+}
+
+int symconst(SExp *sym) {
+        SExp *kv;
+
+        kv = binding(sym, csyms);
+        if (kv != NULL)
+                return fixval(cdr(kv));
+        fprintf(cinit, "        k[%d] = ", nconsts);
+        emitdatum(cinit, sym);
+        fprintf(cinit, ";\n");
+        csyms = cons(cons(sym, mknum(nconsts)), csyms);
+        return nconsts++;
+}
+
+int dataconst(SExp *datum) {
+        fprintf(cinit, "        k[%d] = ", nconsts);
+        emitdatum(cinit, datum);
+        fprintf(cinit, ";\n");
+        return nconsts++;
+}
+
+int cellindex(SExp *var) {
+        SExp *kv;
+
+        kv = binding(var, ccells);
+        if (kv != NULL)
+                return fixval(cdr(kv));
+        ccells = cons(cons(var, mknum(ncells)), ccells);
+        return ncells++;
+}
+
+/* Collect the variables defined in a procedure body onto defs, leaving
+ * out those of procedures nested in it. */
+SExp *localdefs(SExp *exp, SExp *defs) {
+        SExp *var;
+
+        if (!compound(exp) || tagged(exp, "quote") || tagged(exp, "lambda"))
+                return defs;
+        if (tagged(exp, "define") && length(exp) == 3) {
+                var = compound(cadr(exp)) ? car(cadr(exp)) : cadr(exp);
+                if (atomic(var) && !inscope(var, defs))
+                        defs = cons(var, defs);
+                return compound(cadr(exp)) ? defs : localdefs(caddr(exp), defs);
+        }
+        for (; compound(exp); exp = cdr(exp))
+                defs = localdefs(car(exp), defs);
+        return defs;
+}
+
+/* params as a proper list, with any rest parameter last */
+SExp *paramlist(SExp *params) {
+        if (atomic(params))
+                return cons(params, nil);
+        if (!compound(params))
+                return nil;
+        return cons(car(params), paramlist(cdr(params)));
+}
+
+SExp *append(SExp *a, SExp *b) {
+        if (a == nil)
+                return b;
+        return cons(car(a), append(cdr(a), b));
+}
+
+void opencomp(Comp *c, int proc) {
+        memset(c, 0, sizeof(Comp));
+        c->out = open_memstream(&c->text, &c->size);
+        c->temps = 1;
+        c->proc = proc;
+        c->indent = 1;
+}
+
+/* Wrap the code compiled into c in a function, and add it to cfuncs. */
+void closecomp(Comp *c, char *fmt, int n) {
+        fclose(c->out);
+        fprintf(cfuncs, fmt, n);
+        fprintf(cfuncs, " {\n");
+        fprintf(cfuncs, "        SExp *r[%d] = {0};\n", c->temps);
+        fprintf(cfuncs, "        Frame fr = {frames, %d, r};\n\n", c->temps);
+        fprintf(cfuncs, "        frames = &fr;\n");
+        fwrite(c->text, 1, c->size, cfuncs);
+        if (c->fails) {
+                fprintf(cfuncs, "fail:\n");
+                fprintf(cfuncs, "        frames = fr.prev;\n");
+                fprintf(cfuncs, "        return NULL;\n");
+        }
+        fprintf(cfuncs, "}\n\n");
+        free(c->text);
+}
+
+void emit(Comp *c, char *fmt, ...) {
+        va_list ap;
+        int i;
+
+        for (i = 0; i < c->indent; i++)
+                fprintf(c->out, "        ");
+        va_start(ap, fmt);
+        vfprintf(c->out, fmt, ap);
+        va_end(ap);
+        fprintf(c->out, "\n");
+}
+
+void emitcheck(Comp *c, int dst) {
+        emit(c, "if (r[%d] == NULL)", dst);
+        emit(c, "        goto fail;");
+        c->fails = 1;
+}
+
+void emitreturn(Comp *c, int dst) {
+        emit(c, "frames = fr.prev;");
+        emit(c, "return r[%d];", dst);
+}
+
+/* Emit a C expression building datum. */
+void emitdatum(FILE *f, SExp *datum) {
+        if (atomic(datum)) {
+                fprintf(f, "mkatom(");
+                emitname(f, datum);
+                fprintf(f, ")");
+        } else if (number(datum)) {
+                fprintf(f, "mknum(%ldL)", fixval(datum));
+        } else if (compound(datum)) {
+                fprintf(f, "cons(");
+                emitdatum(f, car(datum));
+                fprintf(f, ", ");
+                emitdatum(f, cdr(datum));
+                fprintf(f, ")");
+        } else {
+                fprintf(f, "%s", datum == true ? "true" :
+                                datum == false ? "false" : "nil");
+        }
+}
+
+void emitname(FILE *f, SExp *sym) {
+        char *s;
+        int i;
+
+        s = symname(sym);
+        fprintf(f, "\"");
+        for (i = 0; i < box(sym)->len; i++) {
+                if (s[i] == '"' || s[i] == '\\')
+                        fprintf(f, "\\%c", s[i]);
+                else if (isprint(s[i]))
+                        fprintf(f, "%c", s[i]);
+                else
+                        fprintf(f, "\\%03o", (unsigned char)s[i]);
+        }
+        fprintf(f, "\"");
+}
+
+/* Print the result of a top-level form, or the error it raised, and
+ * collect garbage. */
+void report(SExp *result) {
+        if (result != NULL) {
+                print(result);
+                printf("\n");
+        }
+        if (err != NULL) {
+                /* keep errors in order with the results */
+                fflush(stdout);
+                fprintf(stderr, "Error: %s\n", err);
+        }
+        err = NULL;
+        gc();
+}
+
+#ifndef RUNTIME
+int main(int argc, char **argv) {
+        SExp *input;
+
+        if (argc > 1 && !strcmp(argv[1], "-c"))
+                return compile(stdin, stdout);
+        init();
+        while (!eof) {
+                input = parse(stdin, 0);
+                if (input != NULL)
+                        input = expand(input, nil);
+                if (input != NULL)
+                        input = optimize(input, nil);
+                report(input != NULL ? eval(input, nil) : NULL);
         }
         sweep();
         return 0;
 }
+#endif
@@ -0,0 +1,331 @@
+/*
+ * sexp - Scheme interpreter
+ * Declarations shared by the interpreter and compiled programs
+ * Version 1.0 - December 2011
+ * Written by Eugene D. Ma - <edma12123@gmail.com>
+ *
+ * Copyright (C) 2009-2011 Eugene D. Ma
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef SEXP_H
+#define SEXP_H
+
+#include <stdio.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BUFLEN 1024
+#define SLABSIZE 4096   /* bytes per slab, slabs are aligned to this */
+#define MAXSLABS 4096
+#define STACKLEN (1 << 20) /* argument stack slots */
+#define MAXDEPTH 20000  /* nested evals, well within an 8M C stack */
+#define MARKLEN 4096    /* gc mark stack slots */
+
+#define isreserved(c) (c == ')' || c == '(' || c == '\'')
+
+#define car(p) ((p)->pair[0])
+#define cdr(p) ((p)->pair[1])
+#define cadr(p) (car(cdr(p)))
+#define cddr(p) (cdr(cdr(p)))
+#define caddr(p) (car(cdr(cdr(p))))
+#define cdddr(p) (cdr(cdr(cdr(p))))
+#define cadddr(p) (car(cdr(cdr(cdr(p)))))
+
+enum category {QUOTE, LPAREN, RPAREN, SYM, END};
+
+/* primitives the optimizer knows how to inline, see evalop() */
+enum opcode {
+        OP_NONE,
+        OP_ADD, OP_SUB, OP_MULT, OP_DIV,        /* arithmetic */
+        OP_LT, OP_GT, OP_LTE, OP_GTE, OP_EQL,   /* comparison */
+        OP_CAR, OP_CDR
+};
+#define isarith(op) ((op) >= OP_ADD && (op) <= OP_DIV)
+#define iscmp(op) ((op) >= OP_LT && (op) <= OP_EQL)
+
+/* Values are one word, tagged in the low bits:
+ *   ...xx1  fixnum, the value shifted left one bit
+ *   ...000  pointer to a pair, which is just its car and cdr
+ *   ...010  pointer to a Box, for atoms, primitives and compiled code
+ *   ...110  immediate: (), #t, #f and the runtime's own markers
+ * NULL is not a value, it signals an error. */
+typedef struct SExp SExp;
+struct SExp {
+        SExp *pair[2];
+};
+
+typedef struct Box Box;
+struct Box {
+        enum {ATOM, PRIM, CODE, FREE} type;
+        union {
+                int op;  /* opcode when inlined */
+                int len; /* atoms aren't NUL terminated */
+        };
+        union {
+                char *atom;
+                SExp *(*prim)(int argc, SExp **argv);
+                SExp *(*code)(SExp *env, int argc, SExp **argv);
+                Box *next; /* free list */
+        };
+};
+
+#define TAG_BOX 2
+#define TAG_IMM 6
+#define tagof(p) ((uintptr_t)(p) & 7)
+#define isfix(p) ((uintptr_t)(p) & 1)
+#define ispair(p) (tagof(p) == 0 && (p) != NULL)
+#define isbox(p) (tagof(p) == TAG_BOX)
+#define fixval(p) ((long)((intptr_t)(p) >> 1))
+#define box(p) ((Box *)((uintptr_t)(p) - TAG_BOX))
+#define tagbox(b) ((SExp *)((uintptr_t)(b) + TAG_BOX))
+#define imm(n) ((SExp *)(((uintptr_t)(n) << 3) | TAG_IMM))
+#define symname(p) (box(p)->atom)
+
+#define nil imm(0)     /* empty list */
+#define true imm(1)    /* #t */
+#define false imm(2)   /* #f */
+#define unbound imm(3) /* internal define not yet run, in compiled code */
+#define TAIL imm(4)    /* compiled code returning a tail call, see callc() */
+#define GLOBAL imm(5)  /* heads a cached global reference, see evalglobal() */
+
+/* Compiled procedures are (<code> . env). Their temporaries are kept in
+ * a Frame on the frames stack, so the collector can find them. */
+typedef struct Frame Frame;
+struct Frame {
+        Frame *prev;
+        int n;
+        SExp **slots;
+};
+
+/* Pairs and Boxes are both 16 bytes, and are carved out of aligned
+ * slabs. Slabs hold one or the other, and keep the gc marks for their
+ * slots in a bitmap, so the objects themselves carry no header. DATA
+ * slabs hold the read-only data built by load-data, which the collector
+ * never marks or sweeps. */
+typedef struct Slab Slab;
+struct Slab {
+        unsigned long marks[SLABSIZE / sizeof(SExp) / (8 * sizeof(long))];
+        Slab *next;
+        enum {PAIRS, BOXES, DATA} kind;
+};
+
+#define LONGBITS (8 * sizeof(long))
+#define FIRSTSLOT ((sizeof(Slab) + sizeof(SExp) - 1) / sizeof(SExp))
+#define NSLOTS (SLABSIZE / sizeof(SExp))
+#define slabof(p) ((Slab *)((uintptr_t)(p) & ~(uintptr_t)(SLABSIZE - 1)))
+#define slotof(p) (((uintptr_t)(p) & (SLABSIZE - 1)) / sizeof(SExp))
+
+/** Memory management */
+SExp *alloc(void);
+Box *allocbox(void);
+Slab *newslab(int kind);
+SExp *datacell(void);
+void gc(void);
+void mark(SExp *exp);
+void markone(SExp *exp);
+void rescan(void);
+void sweep(void);
+
+/** Constructors */
+SExp *cons(SExp *car, SExp *cdr);
+SExp *mkatom(char *str);
+SExp *mknum(long n);
+SExp *mkpair(SExp *car, SExp *cdr);
+SExp *mkdata(char *s, int len);
+SExp *mkcode(SExp *(*code)(SExp *, int, SExp **));
+SExp *mklist(int n, SExp **v);
+SExp *mkprim(SExp *(*prim)(int, SExp **), int op);
+SExp *mkproc(SExp *params, SExp *body, SExp *env);
+
+/** I/O */
+int readtoken(FILE *f);
+SExp *parse(FILE *f, int depth);
+SExp *readdata(char **p, char *end);
+SExp *readtail(char **p, char *end, SExp *head, SExp *tail);
+SExp *loaddata(char *path);
+void print(SExp *exp);
+void report(SExp *result);
+
+/** Error handling */
+void seterr(char *msg);
+
+/** Evaluation */
+SExp *apply(SExp *op, int argc, SExp **argv);
+SExp *eval(SExp *exp, SExp *env);
+SExp *evalexp(SExp *exp, SExp *env);
+SExp *push(SExp *exp);
+int evalargs(SExp *args, SExp *env);
+SExp *evallookup(SExp *exp, SExp *env);
+SExp *evalif(SExp *exp, SExp *env);
+SExp *evallambda(SExp *exp, SExp *env);
+SExp *evaldefine(SExp *exp, SExp *env);
+SExp *evalset(SExp *exp, SExp *env);
+SExp *evalbegin(SExp *exp, SExp *env);
+SExp *evalloaddata(SExp *exp, SExp *env);
+SExp *evalapply(SExp *exp, SExp *env);
+SExp *evalprim(SExp *exp, SExp *env);
+SExp *evalglobal(SExp *exp);
+SExp *evalop(int op, SExp *args, SExp *env);
+int atomic(SExp *exp);
+int compound(SExp *exp);
+int empty(SExp *exp);
+int number(SExp *exp);
+int numeric(char *s, int len);
+long tonum(char *s, int len);
+int primproc(SExp *exp);
+int tagged(SExp *ls, char *tag);
+int length(SExp *exp);
+int eqsym(SExp *atom, char *str);
+int samesym(SExp *a, SExp *b);
+
+/** Compiled code */
+SExp *callc(SExp *f, int argc, SExp **argv);
+SExp *tailcall(SExp *f, int argc, SExp **argv);
+SExp *mkframe(int argc, SExp **argv, int nparams, int rest, int ndefs, SExp *env);
+SExp **slot(SExp *env, int depth, int index);
+SExp *gcell(SExp **cache, SExp *var);
+SExp *gref(SExp **cache, SExp *var);
+SExp *gset(SExp **cache, SExp *var, SExp *val);
+SExp *primop(int op, int argc, SExp **argv);
+int compiled(SExp *exp);
+
+/** Optimizer */
+SExp *optimize(SExp *exp, SExp *scope);
+SExp *optlist(SExp *ls, SExp *scope);
+SExp *optbody(SExp *body, SExp *params, SExp *scope);
+SExp *optif(SExp *exp, SExp *scope);
+SExp *optcall(SExp *exp, SExp *scope);
+SExp *defines(SExp *exp, SExp *scope);
+SExp *bindparams(SExp *params, SExp *scope);
+int inscope(SExp *var, SExp *scope);
+int inlinable(SExp *prim, SExp *args);
+int inlined(SExp *exp);
+int globalref(SExp *exp);
+int intact(SExp *exp);
+int constant(SExp *exp);
+
+/** Macros */
+SExp *expand(SExp *exp, SExp *scope);
+SExp *expanduse(SExp *exp, SExp *spec);
+SExp *defsyntax(SExp *exp);
+SExp *macro(SExp *name);
+SExp *usedmacro(SExp *op, SExp *scope);
+SExp *match(SExp *pat, SExp *form, SExp *lits, SExp *b);
+SExp *matchseq(SExp *pat, SExp *forms, SExp *lits, SExp *b);
+SExp *subst(SExp *t, SExp *b, SExp *renames, int quoted);
+SExp *substseq(SExp *t, SExp *rest, SExp *b, SExp *renames, int quoted);
+SExp *substlet(SExp *t, SExp *b, SExp *renames);
+SExp *substbinds(SExp *ls, SExp *b, SExp *renames, SExp *inner);
+SExp *patvars(SExp *pat, SExp *lits, SExp *vars);
+SExp *seqvars(SExp *t, SExp *b, SExp *vars);
+SExp *binders(SExp *t, SExp *b, SExp *renames);
+SExp *freshparams(SExp *ls, SExp *b, SExp *renames);
+SExp *fresh(SExp *var, SExp *b, SExp *renames);
+SExp *gensym(SExp *var);
+SExp *binding(SExp *var, SExp *b);
+int keyword(SExp *var);
+int isellipsis(SExp *exp);
+int isseq(SExp *exp);
+
+/** Environment */
+SExp *envbind(SExp *var, SExp *val, SExp *env);
+SExp *envlookup(SExp *var, SExp *env);
+SExp *framecell(SExp *var, SExp *frame);
+SExp *extend(SExp *params, int argc, SExp **argv, SExp *env);
+SExp *bindargs(int argc, SExp **argv, int nparams, int rest, SExp *vals);
+SExp *globalcell(SExp *var);
+SExp *globalbind(SExp *var, SExp *val);
+int growglobals(void);
+unsigned long hashsym(SExp *sym);
+
+/** Primitives */
+void init(void);
+long arith(int op, long n, long x);
+int compare(int op, long lhs, long rhs);
+SExp *mutate(int argc, SExp **argv, int type);
+SExp *primadd(int argc, SExp **argv);
+SExp *primsub(int argc, SExp **argv);
+SExp *primmult(int argc, SExp **argv);
+SExp *primdiv(int argc, SExp **argv);
+SExp *primcons(int argc, SExp **argv);
+SExp *primcdr(int argc, SExp **argv);
+SExp *primcar(int argc, SExp **argv);
+SExp *primeq(int argc, SExp **argv);
+SExp *primlt(int argc, SExp **argv);
+SExp *primgt(int argc, SExp **argv);
+SExp *primlte(int argc, SExp **argv);
+SExp *primgte(int argc, SExp **argv);
+SExp *primeql(int argc, SExp **argv);
+SExp *primsetcar(int argc, SExp **argv);
+SExp *primsetcdr(int argc, SExp **argv);
+
+/** Compiler */
+typedef struct Comp Comp;
+struct Comp {
+        FILE *out;      /* code for the function being compiled */
+        char *text;     /* its buffer */
+        size_t size;
+        int temps;      /* temporaries used, r[0] holds the environment */
+        int proc;       /* compiling a procedure rather than a form */
+        int fails;      /* whether it jumps to fail */
+        int indent;
+};
+
+int compile(FILE *in, FILE *out);
+int compform(SExp *exp);
+int compfunc(SExp *params, SExp *body, SExp *scope);
+int compexp(Comp *c, SExp *exp, SExp *scope, int dst, int tail);
+int compref(Comp *c, SExp *var, SExp *scope, int dst);
+int complambda(Comp *c, SExp *params, SExp *body, SExp *scope, int dst);
+int compprim(Comp *c, SExp *exp, SExp *scope, int dst);
+int compif(Comp *c, SExp *exp, SExp *scope, int dst, int tail);
+int compdefine(Comp *c, SExp *exp, SExp *scope, int dst);
+int compset(Comp *c, SExp *var, SExp *scope, int dst);
+int compbegin(Comp *c, SExp *exp, SExp *scope, int dst, int tail);
+int compcall(Comp *c, SExp *exp, SExp *scope, int dst, int tail);
+int compargs(Comp *c, SExp *args, SExp *scope, int dst);
+int resolve(SExp *var, SExp *scope, int *depth, int *index);
+int symconst(SExp *sym);
+int dataconst(SExp *datum);
+int cellindex(SExp *var);
+SExp *localdefs(SExp *exp, SExp *defs);
+SExp *append(SExp *a, SExp *b);
+SExp *paramlist(SExp *params);
+void opencomp(Comp *c, int proc);
+void closecomp(Comp *c, char *fmt, int n);
+void emit(Comp *c, char *fmt, ...);
+void emitcheck(Comp *c, int dst);
+void emitreturn(Comp *c, int dst);
+void emitdatum(FILE *f, SExp *datum);
+void emitname(FILE *f, SExp *sym);
+
+/* globals */
+extern char   *err;
+extern int     eof;
+extern int     gcneeded;
+extern Frame  *frames;
+extern SExp   *stack[];
+extern int     sp;
+extern SExp   *tailf;
+extern int     tailargc;
+
+#endif